@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bmat.h"
+#include "generators.h"
+
+// Find the fastest multiply and elimination settings on this host for each of
+// our generator sizes, and write them to the tuning profile that
+// initMatrixModule loads.  We try every SIMD level, multiply method, M4RM table
+// width, blocked tile size, Strassen crossover and thread count that makes
+// sense for the size.  A candidate is only timed if it gets the same product or
+// inverse as the reference code, so a broken setting is never saved.
+
+#define MIN_TIME 0.05 // Seconds to time each candidate for
+#define MAX_CANDIDATES 512
+
+static Matrix A, B, G;
+static Matrix product, GInverse; // Reference results, to reject broken settings
+static TuningProfile candidates[MAX_CANDIDATES];
+static int numCandidates;
+
+static double getTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Add a multiply candidate, with the default settings for anything it does not use.
+static void addCandidate(SimdLevel level, MultiplyMethod method, int m4rmBits, int tileWords,
+    int tileRows, int tablesPerPass, int numThreads, int crossover)
+{
+    TuningProfile *profile = candidates + numCandidates;
+
+    if(numCandidates == MAX_CANDIDATES) {
+        return;
+    }
+    getCurrentProfile(profile);
+    profile->simdLevel = level;
+    profile->multiplyMethod = method;
+    profile->eliminationMethod = ELIMINATE_AUTO;
+    if(m4rmBits != 0) {
+        profile->m4rmBits = m4rmBits;
+    }
+    if(tileWords != 0) {
+        profile->tileWords = tileWords;
+        profile->tileRows = tileRows;
+        profile->tablesPerPass = tablesPerPass;
+    }
+    profile->numThreads = numThreads;
+    if(crossover != 0) {
+        profile->strassenCrossover = crossover;
+    }
+    numCandidates++;
+}
+
+// List the multiply settings worth trying for this size at this SIMD level.
+static void addCandidates(int N, SimdLevel level, int maxThreads)
+{
+    int numWords = (N + 63)/64;
+    int bits, words, rows, tables, threads, crossover;
+
+    addCandidate(level, MULTIPLY_ROWXOR, 0, 0, 0, 0, 1, 0);
+    if(getFixedKernels(numWords, level) != NULL) {
+        addCandidate(level, MULTIPLY_FIXED, 0, 0, 0, 0, 1, 0);
+    }
+    for(bits = 4; bits <= 8; bits++) {
+        addCandidate(level, MULTIPLY_M4RM, bits, 0, 0, 0, 1, 0);
+        for(threads = 2; threads <= maxThreads && N >= 256; threads <<= 1) {
+            addCandidate(level, MULTIPLY_THREADED, bits, 0, 0, 0, threads, 0);
+        }
+    }
+    for(words = numWords; words >= 1; words >>= 1) {
+        for(rows = 64; rows < 2*N; rows <<= 2) {
+            for(tables = 1; tables <= 4; tables <<= 1) {
+                addCandidate(level, MULTIPLY_BLOCKED, 0, words, rows, tables, 1, 0);
+            }
+        }
+    }
+    for(crossover = 128; crossover < N; crossover <<= 1) {
+        addCandidate(level, MULTIPLY_STRASSEN, 0, 0, 0, 0, 1, crossover);
+    }
+}
+
+// Return the average seconds per multiply with the current settings.
+static double timeMultiply(void)
+{
+    double start = getTime();
+    double elapsed;
+    int count = 0;
+
+    do {
+        matrixMultiply(A, B);
+        count++;
+        elapsed = getTime() - start;
+    } while(elapsed < MIN_TIME);
+    return elapsed/count;
+}
+
+// Return the average seconds per inverse with the current settings.
+static double timeInverse(void)
+{
+    double start = getTime();
+    double elapsed;
+    int count = 0;
+
+    do {
+        inverse(G);
+        count++;
+        elapsed = getTime() - start;
+    } while(elapsed < MIN_TIME);
+    return elapsed/count;
+}
+
+// Find the best settings for the N-bit generator.
+static void tuneSize(int N, TuningProfile *best)
+{
+    EliminationMethod eliminationMethods[] = {ELIMINATE_GAUSS_JORDAN, ELIMINATE_FIXED, ELIMINATE_M4RI};
+    SimdLevel level;
+    double time, bestTime = -1.0;
+    long maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    G = getGenerator(N);
+    A = allocateMatrix(matrixMultiply(G, G));
+    B = allocateMatrix(matrixMultiply(A, G));
+    product = allocateMatrix(matrixMultiplySlow(A, B));
+    setEliminationMethod(ELIMINATE_GAUSS_JORDAN);
+    GInverse = allocateMatrix(inverse(G));
+    numCandidates = 0;
+    for(level = SIMD_SCALAR; level <= getSupportedSimdLevel(); level++) {
+        addCandidates(N, level, maxThreads);
+    }
+    for(i = 0; i < numCandidates; i++) {
+        applyProfile(candidates + i);
+        if(!matricesEqual(matrixMultiply(A, B), product)) {
+            printf("N = %d: skipping %s multiply candidate %d, which gave a wrong product\n",
+                N, getMultiplyMethodName(candidates[i].multiplyMethod), i);
+            continue;
+        }
+        time = timeMultiply();
+        if(bestTime < 0.0 || time < bestTime) {
+            bestTime = time;
+            *best = candidates[i];
+        }
+    }
+    printf("N = %d: %s multiply with %s kernels, %.3f ms\n", N,
+        getMultiplyMethodName(best->multiplyMethod), getSimdLevelName(best->simdLevel),
+        1000.0*bestTime);
+    // Now pick the elimination method with the winning multiply settings.
+    bestTime = -1.0;
+    for(i = 0; i < sizeof(eliminationMethods)/sizeof(EliminationMethod); i++) {
+        if(eliminationMethods[i] == ELIMINATE_FIXED &&
+                getFixedKernels((N + 63)/64, best->simdLevel) == NULL) {
+            continue;
+        }
+        applyProfile(best);
+        setEliminationMethod(eliminationMethods[i]);
+        if(!matricesEqual(inverse(G), GInverse)) {
+            printf("N = %d: skipping %s elimination, which gave a wrong inverse\n", N,
+                getEliminationMethodName(eliminationMethods[i]));
+            continue;
+        }
+        time = timeInverse();
+        if(bestTime < 0.0 || time < bestTime) {
+            bestTime = time;
+            best->eliminationMethod = eliminationMethods[i];
+        }
+    }
+    printf("N = %d: %s elimination, %.3f ms\n", N,
+        getEliminationMethodName(best->eliminationMethod), 1000.0*bestTime);
+    deleteMatrix(A);
+    deleteMatrix(B);
+    deleteMatrix(product);
+    deleteMatrix(GInverse);
+    deleteMatrix(G);
+}
+
+int main(int argc, char **argv)
+{
+    TuningProfile profiles[64];
+    char *fileName;
+    int numProfiles = getNumGenerators();
+    int i;
+
+    if(argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        printf("Usage: autotune [profileFile]\n"
+            "    The default profile is $BMAT_PROFILE, or ~/.bmat_profile\n");
+        return 1;
+    }
+    fileName = argc == 2? argv[1] : getProfileFile();
+    setProfileFile(NULL); // Do not load an old profile while tuning
+    for(i = 0; i < numProfiles; i++) {
+        tuneSize(getGeneratorSize(i), profiles + i);
+    }
+    setProfileFile(fileName);
+    if(!writeProfiles(profiles, numProfiles)) {
+        return 1;
+    }
+    printf("Wrote profile %s\n", fileName);
+    return 0;
+}
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE // For syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "bmat.h"
+
+// Time the matrix multiply kernels, find the Strassen crossover size for this
+// host, compare the cache misses of the blocked and M4RM multiplies, and compare
+// the constant-time matrixPow with the branchy one.
+
+#define NUM_COUNTERS 4
+static char *counterNames[NUM_COUNTERS] = {
+    "L1D loads", "L1D load misses", "LLC loads", "LLC load misses"
+};
+
+static double getTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Create a random matrix, with the bits past column N cleared.
+static Matrix createRandomMatrix(int N)
+{
+    int numWords = (N + 63)/64;
+    uint64 *data = (uint64 *)calloc(N*numWords, sizeof(uint64));
+    Matrix M;
+    int row, word;
+
+    for(row = 0; row < N; row++) {
+        for(word = 0; word < numWords; word++) {
+            data[row*numWords + word] = randomUint64();
+        }
+        if(N & 0x3f) {
+            data[row*numWords + numWords - 1] &= (1LL << (N & 0x3f)) - 1;
+        }
+    }
+    M = createMatrix(data);
+    free(data);
+    return M;
+}
+
+// Return the average milliseconds per multiply with the given method.
+static double timeMultiply(Matrix A, Matrix B, MultiplyMethod method)
+{
+    double start, elapsed;
+    int count = 0;
+
+    setMultiplyMethod(method);
+    start = getTime();
+    do {
+        matrixMultiply(A, B);
+        count++;
+        elapsed = getTime() - start;
+    } while(elapsed < 0.5);
+    return 1000.0*elapsed/count;
+}
+
+// Try crossovers from 64 bits up to N, and return the fastest.
+static int findStrassenCrossover(Matrix A, Matrix B, int N)
+{
+    int crossover, bestCrossover = N;
+    double time, bestTime = timeMultiply(A, B, MULTIPLY_M4RM);
+
+    printf("M4RM: %.3f ms\n", bestTime);
+    for(crossover = 128; crossover < N; crossover <<= 1) {
+        setStrassenCrossover(crossover);
+        time = timeMultiply(A, B, MULTIPLY_STRASSEN);
+        printf("Strassen with crossover %d: %.3f ms\n", crossover, time);
+        if(time < bestTime) {
+            bestTime = time;
+            bestCrossover = crossover;
+        }
+    }
+    return bestCrossover;
+}
+
+// Return the average milliseconds per matrixPow with a random N-bit exponent.
+static double timePow(Matrix A, int N, bool constantTime)
+{
+    Bignum n = createBignum(0, N);
+    double start, elapsed;
+    int count = 0;
+    int i;
+
+    for(i = 0; i < N; i++) {
+        setBignumBit(n, i, randomBool());
+    }
+    setMultiplyMethod(MULTIPLY_AUTO);
+    setConstantTime(constantTime);
+    start = getTime();
+    do {
+        matrixPow(A, n);
+        count++;
+        elapsed = getTime() - start;
+    } while(elapsed < 1.0);
+    setConstantTime(false);
+    deleteBignum(n);
+    return 1000.0*elapsed/count;
+}
+
+// Show the time of the branchy and constant-time matrixPow.
+static void comparePow(Matrix A, int N)
+{
+    double branchy = timePow(A, N, false);
+    double constantTime = timePow(A, N, true);
+
+    printf("Branchy matrixPow: %.3f ms\n", branchy);
+    printf("Constant-time matrixPow: %.3f ms (%.2fx)\n", constantTime, constantTime/branchy);
+}
+
+#ifdef __linux__
+// Open a hardware cache event counter for this process, or return -1.
+static int openCacheCounter(int cache, int result)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Count cache loads and misses over count multiplies with the method.  Return
+// false if the performance counters are not available.
+static bool countCacheMisses(Matrix A, Matrix B, MultiplyMethod method, int count,
+    long long counts[NUM_COUNTERS])
+{
+#ifdef __linux__
+    int caches[NUM_COUNTERS] = {PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_L1D,
+        PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_LL};
+    int results[NUM_COUNTERS] = {PERF_COUNT_HW_CACHE_RESULT_ACCESS,
+        PERF_COUNT_HW_CACHE_RESULT_MISS, PERF_COUNT_HW_CACHE_RESULT_ACCESS,
+        PERF_COUNT_HW_CACHE_RESULT_MISS};
+    int fds[NUM_COUNTERS];
+    bool available = true;
+    int i;
+
+    setMultiplyMethod(method);
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        fds[i] = openCacheCounter(caches[i], results[i]);
+        available = available && fds[i] >= 0;
+    }
+    if(available) {
+        for(i = 0; i < NUM_COUNTERS; i++) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+        for(i = 0; i < count; i++) {
+            matrixMultiply(A, B);
+        }
+        for(i = 0; i < NUM_COUNTERS; i++) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if(read(fds[i], &counts[i], sizeof(long long)) != sizeof(long long)) {
+                available = false;
+            }
+        }
+    }
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        if(fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Show the time and cache miss rates of the M4RM and blocked multiplies.
+static void compareCacheMisses(Matrix A, Matrix B)
+{
+    MultiplyMethod methods[] = {MULTIPLY_M4RM, MULTIPLY_BLOCKED};
+    char *names[] = {"M4RM", "blocked"};
+    long long counts[NUM_COUNTERS];
+    int l1Size, l2Size, words, rows, tables;
+    int i, j;
+
+    getCacheSizes(&l1Size, &l2Size);
+    getTileSizes(&words, &rows, &tables);
+    printf("L1 cache %dK, L2 cache %dK: tiles are %d words by %d rows, %d tables per pass\n",
+        l1Size >> 10, l2Size >> 10, words, rows, tables);
+    for(i = 0; i < sizeof(methods)/sizeof(MultiplyMethod); i++) {
+        printf("%s: %.3f ms\n", names[i], timeMultiply(A, B, methods[i]));
+        if(!countCacheMisses(A, B, methods[i], 10, counts)) {
+            printf("    Cache counters are not available\n");
+            continue;
+        }
+        for(j = 0; j < NUM_COUNTERS; j++) {
+            printf("    %s: %lld per multiply\n", counterNames[j], counts[j]/10);
+        }
+        printf("    L1D miss rate %.2f%%, LLC miss rate %.2f%%\n",
+            100.0*counts[1]/(counts[0] + 1), 100.0*counts[3]/(counts[2] + 1));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    MultiplyMethod methods[] = {MULTIPLY_ROWXOR, MULTIPLY_M4RM, MULTIPLY_STRASSEN,
+        MULTIPLY_FIXED, MULTIPLY_BLOCKED, MULTIPLY_THREADED, MULTIPLY_MASKED};
+    char *names[] = {"row XOR", "M4RM", "Strassen", "fixed width", "blocked", "threaded",
+        "masked"};
+    Matrix A, B;
+    int N, i;
+
+    if(argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[1], "-c") && strcmp(argv[1], "-m") &&
+            strcmp(argv[1], "-p"))) {
+        printf("Usage: benchmatrix [-c|-m|-p] size\n"
+            "    -c : Find the Strassen crossover size for this host\n"
+            "    -m : Compare cache misses of the blocked and M4RM multiplies\n"
+            "    -p : Compare the constant-time and branchy matrixPow\n");
+        return 1;
+    }
+    N = atoi(argv[argc - 1]);
+    if(N < 2) {
+        printf("size must be >= 2\n");
+        return 1;
+    }
+    initMatrixModule(N);
+    initRandomModule(false);
+    if(!multiplyTest() || !fixedKernelTest() || !eliminationTest() || !transposeTest() ||
+            !sparseTest() || !polynomialTest() || !smallMatrixTest() || !powTest()) {
+        return 1;
+    }
+    A = createRandomMatrix(N);
+    B = createRandomMatrix(N);
+    printf("Using %s kernels and %d threads\n", getSimdLevelName(getSimdLevel()),
+        getNumThreads());
+    if(argc == 3 && !strcmp(argv[1], "-m")) {
+        compareCacheMisses(A, B);
+        return 0;
+    }
+    if(argc == 3 && !strcmp(argv[1], "-p")) {
+        comparePow(A, N);
+        return 0;
+    }
+    if(argc == 3) {
+        printf("Best Strassen crossover for N = %d is %d\n", N,
+            findStrassenCrossover(A, B, N));
+        return 0;
+    }
+    printf("Strassen crossover is %d\n", getStrassenCrossover());
+    for(i = 0; i < sizeof(methods)/sizeof(MultiplyMethod); i++) {
+        printf("%s: %.3f ms\n", names[i], timeMultiply(A, B, methods[i]));
+    }
+    return 0;
+}
@@ -147,7 +147,7 @@ Bignum readKey(char *fileName, bool isPrivateKey)
         pos += numRead;
     } while(numRead > 0);
     fclose(file);
-    bits = ((unsigned)buffer[0]) | (((unsigned)buffer[1] & 0x7) << 8);
+    bits = ((unsigned)buffer[0]) | (((unsigned)buffer[1] & 0x7f) << 8);
     if(pos != (bits + 7)/8 + 2) {
         printf("Key file %s has incorrect size.\n", fileName);
         return NULL;
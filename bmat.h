@@ -6,6 +6,32 @@ typedef unsigned long long uint64;
 typedef struct MatrixStruct *Matrix;
 typedef struct HashTableStruct *HashTable;
 typedef struct BignumStruct *Bignum;
+typedef struct SparseMatrixStruct *SparseMatrix;
+typedef struct FieldStruct *Field;
+typedef struct RecodedExponentStruct *RecodedExponent;
+typedef enum {
+    MULTIPLY_AUTO, // Strassen above the crossover, else the best kernel that fits cache
+    MULTIPLY_ROWXOR, // XOR a row of B into the result for each set bit of A
+    MULTIPLY_M4RM, // Method of Four Russians, with Gray code tables of B's rows
+    MULTIPLY_STRASSEN, // Strassen-Winograd recursion down to M4RM blocks
+    MULTIPLY_FIXED, // Kernels compiled for this exact row width, if there are any
+    MULTIPLY_BLOCKED, // M4RM tiled to keep its tables and result rows in L2
+    MULTIPLY_THREADED, // M4RM split by row ranges across the thread pool
+    MULTIPLY_MASKED // Constant-time: masks rather than branches on the bits of A
+} MultiplyMethod;
+typedef enum {
+    ELIMINATE_AUTO, // The fixed-width kernel for one word rows, else blocked M4RI
+    ELIMINATE_GAUSS_JORDAN, // Row XORs, with pivot columns cleared by the thread pool
+    ELIMINATE_FIXED, // Kernels compiled for this exact row width, if there are any
+    ELIMINATE_M4RI // Pivots found a block of columns at a time, then cleared with Gray code tables
+} EliminationMethod;
+typedef void (*ParallelFunc)(void *context, int start, int end);
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+} SimdLevel;
 
 // ARC4 interface
 #define KEY_LENGTH 256
@@ -21,22 +47,176 @@ byte hashChar(byte c);
 // Matrix interface
 void initMatrixModule(int width);
 Matrix randomGoodMatrix(void);
+Matrix randomSparseGoodMatrix(int maxRowWeight);
 void showMatrixInHex(Matrix A);
 void showMatrix(Matrix A);
 Bignum getMatrixColumn(Matrix A, int column);
+Matrix getTransposed(Matrix M);
+bool transposeTest(void);
+bool smallMatrixTest(void);
+bool sparseTest(void);
+bool polynomialTest(void);
 Bignum getMatrixRow(Matrix A, int row);
 Matrix matrixMultiply(Matrix A, Matrix B);
+Matrix matrixMultiplySlow(Matrix A, Matrix B);
+void matrixMultiplyInto(Matrix res, Matrix A, Matrix B);
+void matrixMultiplyAccumulate(Matrix res, Matrix A, Matrix B);
+void matrixSquareInto(Matrix res, Matrix A);
+void matrixSquareInPlace(Matrix A);
+void setMultiplyMethod(MultiplyMethod method);
+MultiplyMethod getMultiplyMethod(void);
+void setConstantTime(bool value);
+bool getConstantTime(void);
+char *getMultiplyMethodName(MultiplyMethod method);
+void setEliminationMethod(EliminationMethod method);
+EliminationMethod getEliminationMethod(void);
+char *getEliminationMethodName(EliminationMethod method);
+void setStrassenCrossover(int size);
+int getStrassenCrossover(void);
+void setM4RMBits(int bits);
+int getM4RMBits(void);
+void setCacheSizes(int l1Size, int l2Size);
+void getCacheSizes(int *l1Size, int *l2Size);
+void setTileSizes(int words, int rows, int tables);
+void getTileSizes(int *words, int *rows, int *tables);
+bool multiplyTest(void);
+bool fixedKernelTest(void);
+bool eliminationTest(void);
+Matrix inverse(Matrix M);
 Matrix matrixPow(Matrix A, Bignum n);
+int chooseWindowBits(int bits);
+RecodedExponent recodeExponent(Bignum n, int windowBits);
+void deleteRecodedExponent(RecodedExponent e);
+Matrix matrixPowRecoded(Matrix M, RecodedExponent e);
 int getMatrixSize(void);
 Bignum matrixMultiplyVector(Matrix A, Bignum n);
+Bignum vectorMultiplyMatrix(Bignum v, Matrix A);
+bool isSingular(Matrix M);
+int getMatrixRank(Matrix M);
+bool matricesEqual(Matrix A, Matrix B);
 Matrix createMatrix(uint64 *data);
 void deleteMatrix(Matrix M);
-void powTest(void);
+bool powTest(void);
 Matrix allocateMatrix(Matrix oldM);
 Matrix reconstructMatrix(Matrix G, Bignum h);
+void reconstructMatrices(Matrix G, Bignum *keys, Matrix *results, int numKeys);
+Matrix krylovMatrix(Matrix G, Bignum v);
+Matrix getReconstructionBasis(Matrix G);
+Matrix squaringMap(Matrix G, Matrix CInverse);
+Bignum vectorMinimalPolynomial(Matrix A, Bignum v);
+Bignum characteristicPolynomial(Matrix A);
+Bignum minimalPolynomial(Matrix A);
+bool writeReconstructionBasis(char *fileName, Matrix G);
+bool readReconstructionBasis(char *fileName, Matrix G);
 bool checkPrimeOrderTheory(void);
+int getMatrixWeight(Matrix M);
+SparseMatrix createSparseMatrix(Matrix M);
+SparseMatrix sparseFormOf(Matrix M);
+void deleteSparseMatrix(SparseMatrix S);
+int getSparseMatrixWeight(SparseMatrix S);
+Matrix sparseMultiply(SparseMatrix S, Matrix B);
+void sparseMultiplyInto(Matrix res, SparseMatrix S, Matrix B);
+Bignum vectorMultiplySparse(Bignum v, SparseMatrix S);
 extern byte parityTable[1 << 16];
 
+// SIMD row kernel interface
+void initSimdModule(void);
+void setSimdLevel(SimdLevel level);
+SimdLevel getSimdLevel(void);
+SimdLevel getSupportedSimdLevel(void);
+char *getSimdLevelName(SimdLevel level);
+extern void (*xorRowWords)(uint64 *dest, uint64 *source, int numWords);
+extern void (*xorRowWords3)(uint64 *dest, uint64 *a, uint64 *b, int numWords);
+extern uint64 (*andXorWords)(uint64 *a, uint64 *b, int numWords);
+extern int (*dotProductWords)(uint64 *a, uint64 *b, int numWords);
+extern void (*transposeBlock)(uint64 *block);
+bool popcountSupported(void);
+void setUsePopcount(bool value);
+bool getUsePopcount(void);
+
+// Fixed-width kernel interface.  Matrices are N rows of numWords words.
+typedef struct {
+    void (*multiply)(uint64 *res, uint64 *A, uint64 *B, int N);
+    void (*square)(uint64 *res, uint64 *A, int N);
+    void (*vectorMultiply)(uint64 *res, uint64 *v, uint64 *A, int N);
+    void (*multiplyVector)(uint64 *res, uint64 *A, uint64 *v, int N);
+    int (*eliminate)(uint64 *A, uint64 *I, int N);
+    void (*multiplyMasked)(uint64 *res, uint64 *A, uint64 *B, int numRows, int N);
+    void (*vectorMultiplyMasked)(uint64 *res, uint64 *v, uint64 *A, int N);
+} FixedKernels;
+FixedKernels *getFixedKernels(int numWords, SimdLevel level);
+
+// Thread pool interface
+void setNumThreads(int count);
+int getNumThreads(void);
+int getThreadIndex(void);
+void runInParallel(ParallelFunc func, void *context, int numRows, int minRows);
+
+// Tuning profile interface
+typedef struct {
+    int N;
+    MultiplyMethod multiplyMethod;
+    EliminationMethod eliminationMethod;
+    SimdLevel simdLevel;
+    int m4rmBits;
+    int tileWords, tileRows, tablesPerPass;
+    int numThreads;
+    int strassenCrossover;
+} TuningProfile;
+char *getProfileFile(void);
+void setProfileFile(char *fileName);
+void getCurrentProfile(TuningProfile *profile);
+void applyProfile(TuningProfile *profile);
+bool readProfile(int N, TuningProfile *profile);
+bool writeProfiles(TuningProfile *profiles, int numProfiles);
+
+// Small matrix interface, for N <= 64.  For N <= 8, the matrix is packed into
+// rows[0], with row r in byte r.
+typedef struct {
+    uint64 rows[64];
+} SmallMatrix;
+void setSmallMatrixSize(int N);
+int getSmallMatrixSize(void);
+void smallMultiply(SmallMatrix *res, const SmallMatrix *A, const SmallMatrix *B);
+void smallIdentity(SmallMatrix *res);
+bool smallEqual(const SmallMatrix *A, const SmallMatrix *B);
+void smallPow(SmallMatrix *res, const SmallMatrix *A, uint64 n);
+int smallRank(const SmallMatrix *M);
+bool smallIsSingular(const SmallMatrix *M);
+void smallRandomMatrix(SmallMatrix *M);
+void smallRandomNonSingularMatrix(SmallMatrix *M);
+bool smallHasGoodPowerOrder(const SmallMatrix *A);
+uint64 smallFindOrder(const SmallMatrix *A);
+bool smallCheckPrimeOrderTheory(void);
+
+// Polynomial field interface.  Elements are N bit Bignums holding polynomials
+// in G, modulo G's characteristic polynomial.
+Field createField(Matrix G);
+void deleteField(Field F);
+Bignum getFieldModulus(Field F);
+Bignum fieldMultiply(Field F, Bignum a, Bignum b);
+Bignum fieldSquare(Field F, Bignum a);
+Bignum fieldPow(Field F, Bignum a, Bignum n);
+Bignum fieldPowX(Field F, Bignum n);
+Bignum rowToPoly(Field F, Bignum row);
+Bignum polyToRow(Field F, Bignum p);
+Bignum squareRow(Field F, Bignum row, int k);
+Bignum matrixPowRow(Matrix G, Bignum h, Bignum n);
+void buildCombTable(Field F, int combBits);
+bool writeCombTable(Field F, char *fileName);
+bool loadCombTable(Field F, char *fileName);
+bool clmulSupported(void);
+void setUseClmul(bool value);
+bool getUseClmul(void);
+bool fieldTest(Matrix G);
+int polyDegree(Bignum a);
+Bignum polyMultiply(Bignum a, Bignum b);
+Bignum polyDivide(Bignum a, Bignum b);
+Bignum polyRemainder(Bignum a, Bignum b);
+Bignum polyGcd(Bignum a, Bignum b);
+bool isIrreducible(Bignum f);
+Bignum randomIrreduciblePolynomial(int n);
+
 // Bignum interface
 int getBignumSize(Bignum n);
 bool getBignumBit(Bignum n, int bit);
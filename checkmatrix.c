@@ -3,17 +3,28 @@
 #include "bmat.h"
 
 // Just check the theory that our method of choosing good generator matrices
-// works, by brute-force computing their order.
+// works, by brute-force computing their order.  With one size, keep checking
+// it forever.  With a range of sizes, check each once.  Sizes up to 64 use the
+// small matrix engine.
 int main(int argc, char **argv)
 {
-    //int N;
+    int minN = 61, maxN = 61;
+    int N;
 
+    if(argc > 3 || (argc >= 2 && (minN = maxN = atoi(argv[1])) < 2) ||
+            (argc == 3 && (maxN = atoi(argv[2])) < minN)) {
+        printf("Usage: checkmatrix [size [maxSize]]\n");
+        return 1;
+    }
     initRandomModule(true);
-    //initMatrixModule(2);
-    //for(N = 2; N < 40; N++) {
-    initMatrixModule(61);
-    while(true) {
-        //initMatrixModule(N);
+    if(argc < 3) {
+        initMatrixModule(minN);
+        while(true) {
+            checkPrimeOrderTheory();
+        }
+    }
+    for(N = minN; N <= maxN; N++) {
+        initMatrixModule(N);
         checkPrimeOrderTheory();
     }
     return 0;
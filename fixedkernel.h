@@ -0,0 +1,263 @@
+// Matrix kernels for rows of exactly W words.  This file is included by
+// fixedkernels.c once for each width and instruction set, with W, NAME and
+// TARGET defined.  Because W is a constant, the compiler fully unrolls every
+// row operation, and small rows stay in registers.
+
+// Multiply A*B into res.  Rows of up to SMALL_WORDS words use a 4-bit table for
+// every slice of B up front, so each result row is built in registers with one
+// lookup per slice.  Wider rows use the usual M4RM order, with 8-bit slices that
+// never straddle a word.
+TARGET static void NAME(multiply)(uint64 *res, uint64 *A, uint64 *B, int N)
+{
+    int row, slice, numBits, i, j;
+    unsigned index;
+
+    if(W <= SMALL_WORDS) {
+        uint64 tables[(64*W/SMALL_TABLE_BITS) << SMALL_TABLE_BITS][W];
+        uint64 acc[W];
+        int numSlices = (N + SMALL_TABLE_BITS - 1)/SMALL_TABLE_BITS;
+        uint64 (*table)[W];
+
+        for(slice = 0; slice < numSlices; slice++) {
+            table = tables + (slice << SMALL_TABLE_BITS);
+            numBits = N - slice*SMALL_TABLE_BITS;
+            if(numBits > SMALL_TABLE_BITS) {
+                numBits = SMALL_TABLE_BITS;
+            }
+            for(j = 0; j < W; j++) {
+                table[0][j] = 0;
+            }
+            for(i = 1; i < (1 << numBits); i++) {
+                for(j = 0; j < W; j++) {
+                    table[i][j] = table[i & (i - 1)][j] ^
+                        B[(slice*SMALL_TABLE_BITS + __builtin_ctz(i))*W + j];
+                }
+            }
+        }
+        for(row = 0; row < N; row++) {
+            for(j = 0; j < W; j++) {
+                acc[j] = 0;
+            }
+            for(slice = 0; slice < numSlices; slice++) {
+                index = (A[row*W + slice*SMALL_TABLE_BITS/64] >>
+                    ((slice*SMALL_TABLE_BITS) & 0x3f)) & ((1 << SMALL_TABLE_BITS) - 1);
+                for(j = 0; j < W; j++) {
+                    acc[j] ^= tables[(slice << SMALL_TABLE_BITS) + index][j];
+                }
+            }
+            for(j = 0; j < W; j++) {
+                res[row*W + j] = acc[j];
+            }
+        }
+    } else {
+        uint64 table[256][W];
+
+        for(slice = 0; slice*8 < N; slice++) {
+            numBits = N - slice*8 > 8? 8 : N - slice*8;
+            for(j = 0; j < W; j++) {
+                table[0][j] = 0;
+            }
+            for(i = 1; i < (1 << numBits); i++) {
+                for(j = 0; j < W; j++) {
+                    table[i][j] = table[i & (i - 1)][j] ^ B[(slice*8 + __builtin_ctz(i))*W + j];
+                }
+            }
+            for(row = 0; row < N; row++) {
+                index = (A[row*W + (slice >> 3)] >> ((slice & 7)*8)) & 0xff;
+                if(slice == 0) {
+                    for(j = 0; j < W; j++) {
+                        res[row*W + j] = table[index][j];
+                    }
+                } else {
+                    for(j = 0; j < W; j++) {
+                        res[row*W + j] ^= table[index][j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Multiply the first numRows rows of A by B into res without branching on or
+// indexing by the bits of A, so the time does not depend on the data.  Each bit
+// of A becomes an all-ones or all-zeros mask on the matching row of B.  We build
+// MASKED_VECTORS*VECTOR_WORDS result rows at once: acc[j][v] holds word j of
+// VECTOR_WORDS of those rows, so the masks for one bit of A fill a few vectors,
+// and each word of the row of B is broadcast once and ANDed with them.
+TARGET static void NAME(multiplyMasked)(uint64 *res, uint64 *A, uint64 *B, int numRows, int N)
+{
+    typedef uint64 Vector __attribute__((vector_size(VECTOR_WORDS*sizeof(uint64))));
+    Vector acc[W][MASKED_VECTORS];
+    Vector words[MASKED_VECTORS] = {{0}};
+    Vector mask[MASKED_VECTORS];
+    uint64 *BRow;
+    uint64 word;
+    int row, rows, xWord, bit, numBits, r, v, j;
+
+    for(row = 0; row < numRows; row += MASKED_VECTORS*VECTOR_WORDS) {
+        rows = numRows - row;
+        for(j = 0; j < W; j++) {
+            for(v = 0; v < MASKED_VECTORS; v++) {
+                acc[j][v] ^= acc[j][v];
+            }
+        }
+        for(xWord = 0; xWord < W; xWord++) {
+            for(v = 0; v < MASKED_VECTORS; v++) {
+                for(r = 0; r < VECTOR_WORDS; r++) {
+                    // Past the last row, reuse it rather than read beyond A.
+                    words[v][r] = A[(row + (v*VECTOR_WORDS + r < rows? v*VECTOR_WORDS + r : 0))*W +
+                        xWord];
+                }
+            }
+            numBits = N - (xWord << 6) < 64? N - (xWord << 6) : 64;
+            BRow = B + (xWord << 6)*W;
+            for(bit = 0; bit < numBits; bit++) {
+                for(v = 0; v < MASKED_VECTORS; v++) {
+                    mask[v] = -(words[v] & 1);
+                    words[v] >>= 1;
+                }
+                for(j = 0; j < W; j++) {
+                    word = BRow[j];
+                    for(v = 0; v < MASKED_VECTORS; v++) {
+                        acc[j][v] ^= word & mask[v];
+                    }
+                }
+                BRow += W;
+            }
+        }
+        for(v = 0; v < MASKED_VECTORS; v++) {
+            for(r = 0; r < VECTOR_WORDS && v*VECTOR_WORDS + r < rows; r++) {
+                for(j = 0; j < W; j++) {
+                    res[(row + v*VECTOR_WORDS + r)*W + j] = acc[j][v][r];
+                }
+            }
+        }
+    }
+}
+
+// Square A into res.
+TARGET static void NAME(square)(uint64 *res, uint64 *A, int N)
+{
+    NAME(multiply)(res, A, A, N);
+}
+
+// Set res to the row vector v times A.  Bits of v at or past N are ignored, since
+// A has no rows for them.
+TARGET static void NAME(vectorMultiply)(uint64 *res, uint64 *v, uint64 *A, int N)
+{
+    uint64 acc[W];
+    uint64 word;
+    int xWord, row, j;
+
+    for(j = 0; j < W; j++) {
+        acc[j] = 0;
+    }
+    for(xWord = 0; xWord < W; xWord++) {
+        word = v[xWord];
+        if(xWord == W - 1 && (N & 0x3f) != 0) {
+            word &= ((uint64)1 << (N & 0x3f)) - 1;
+        }
+        while(word != 0) {
+            row = (xWord << 6) + __builtin_ctzll(word);
+            for(j = 0; j < W; j++) {
+                acc[j] ^= A[row*W + j];
+            }
+            word &= word - 1;
+        }
+    }
+    for(j = 0; j < W; j++) {
+        res[j] = acc[j];
+    }
+}
+
+// Set res to the row vector v times A without branching on the bits of v, for
+// constant-time mode.  Each bit of v becomes a mask on its row of A.
+TARGET static void NAME(vectorMultiplyMasked)(uint64 *res, uint64 *v, uint64 *A, int N)
+{
+    uint64 acc[W];
+    uint64 mask;
+    int row, j;
+
+    for(j = 0; j < W; j++) {
+        acc[j] = 0;
+    }
+    for(row = 0; row < N; row++) {
+        mask = (uint64)((long long)(v[row >> 6] << (63 - (row & 0x3f))) >> 63);
+        for(j = 0; j < W; j++) {
+            acc[j] ^= A[row*W + j] & mask;
+        }
+    }
+    for(j = 0; j < W; j++) {
+        res[j] = acc[j];
+    }
+}
+
+// Set res to A times the column vector v.
+TARGET static void NAME(multiplyVector)(uint64 *res, uint64 *A, uint64 *v, int N)
+{
+    uint64 value;
+    int row, j;
+
+    for(j = 0; j < W; j++) {
+        res[j] = 0;
+    }
+    for(row = 0; row < N; row++) {
+        value = 0;
+        for(j = 0; j < W; j++) {
+            value ^= A[row*W + j] & v[j];
+        }
+        res[row >> 6] |= (uint64)__builtin_parityll(value) << (row & 0x3f);
+    }
+}
+
+// Gaussian elimination on A, returning its rank.  If I is not NULL, A is fully
+// reduced, and the same row operations are done to I, so if I starts as the
+// identity and A is non-singular, I ends up as the inverse of A.
+TARGET static int NAME(eliminate)(uint64 *A, uint64 *I, int N)
+{
+    uint64 temp, mask;
+    int rank = 0;
+    int col, row, pivot, word, j;
+
+    for(col = 0; col < N; col++) {
+        word = col >> 6;
+        mask = 1LL << (col & 0x3f);
+        for(pivot = rank; pivot < N && !(A[pivot*W + word] & mask); pivot++);
+        if(pivot == N) {
+            continue;
+        }
+        if(pivot != rank) {
+            for(j = 0; j < W; j++) {
+                temp = A[pivot*W + j];
+                A[pivot*W + j] = A[rank*W + j];
+                A[rank*W + j] = temp;
+            }
+            if(I != NULL) {
+                for(j = 0; j < W; j++) {
+                    temp = I[pivot*W + j];
+                    I[pivot*W + j] = I[rank*W + j];
+                    I[rank*W + j] = temp;
+                }
+            }
+        }
+        for(row = I != NULL? 0 : rank + 1; row < N; row++) {
+            if(row != rank && (A[row*W + word] & mask)) {
+                for(j = 0; j < W; j++) {
+                    A[row*W + j] ^= A[rank*W + j];
+                }
+                if(I != NULL) {
+                    for(j = 0; j < W; j++) {
+                        I[row*W + j] ^= I[rank*W + j];
+                    }
+                }
+            }
+        }
+        rank++;
+    }
+    return rank;
+}
+
+static FixedKernels NAME(kernels) = {
+    NAME(multiply), NAME(square), NAME(vectorMultiply), NAME(multiplyVector), NAME(eliminate),
+    NAME(multiplyMasked), NAME(vectorMultiplyMasked)
+};
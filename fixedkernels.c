@@ -0,0 +1,133 @@
+// Matrix kernels specialized for the row widths of our shipped generators: 1
+// word for N <= 61, 2 for 89, 107 and 127, 9 for 521 and 10 for 607.  Each
+// width is compiled once per instruction set, so the unrolled loops also get
+// vectorized for the SIMD level chosen at run time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_SIMD
+#endif
+
+#define SMALL_WORDS 2 // Rows this short keep all their M4RM tables in L1 cache
+#define SMALL_TABLE_BITS 4
+
+// VECTOR_WORDS is the SIMD register width in words, and multiplyMasked keeps
+// MASKED_VECTORS registers of result rows per word of the row: as many as fit
+// in the register file along with the rest of its working set.
+#define NAME(name) name##1
+#define W 1
+#define TARGET
+#define VECTOR_WORDS 2
+#define MASKED_VECTORS 2
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##2
+#define W 2
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##9
+#define W 9
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##10
+#define W 10
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#undef TARGET
+#undef VECTOR_WORDS
+#undef MASKED_VECTORS
+
+#ifdef X86_SIMD
+// Every CPU with AVX2 also has POPCNT, which multiplyVector uses for parity.
+#define TARGET __attribute__((target("avx2,popcnt")))
+#define VECTOR_WORDS 4
+#define MASKED_VECTORS 1
+#define NAME(name) name##1AVX2
+#define W 1
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##2AVX2
+#define W 2
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##9AVX2
+#define W 9
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##10AVX2
+#define W 10
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#undef TARGET
+#undef VECTOR_WORDS
+#undef MASKED_VECTORS
+
+#define TARGET __attribute__((target("avx512f,popcnt")))
+#define VECTOR_WORDS 8
+#define MASKED_VECTORS 2
+#define NAME(name) name##1AVX512
+#define W 1
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##2AVX512
+#define W 2
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##9AVX512
+#define W 9
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#define NAME(name) name##10AVX512
+#define W 10
+#include "fixedkernel.h"
+#undef NAME
+#undef W
+#undef TARGET
+#undef VECTOR_WORDS
+#undef MASKED_VECTORS
+#endif
+
+// Return the kernels for rows of numWords words at the SIMD level, or NULL if
+// there are none for that width.
+FixedKernels *getFixedKernels(int numWords, SimdLevel level)
+{
+#ifdef X86_SIMD
+    if(level == SIMD_AVX512) {
+        switch(numWords) {
+        case 1: return &kernels1AVX512;
+        case 2: return &kernels2AVX512;
+        case 9: return &kernels9AVX512;
+        case 10: return &kernels10AVX512;
+        }
+    } else if(level == SIMD_AVX2) {
+        switch(numWords) {
+        case 1: return &kernels1AVX2;
+        case 2: return &kernels2AVX2;
+        case 9: return &kernels9AVX2;
+        case 10: return &kernels10AVX2;
+        }
+    }
+#endif
+    switch(numWords) {
+    case 1: return &kernels1;
+    case 2: return &kernels2;
+    case 9: return &kernels9;
+    case 10: return &kernels10;
+    }
+    return NULL;
+}
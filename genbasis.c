@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bmat.h"
+#include "generators.h"
+
+// Write the precomputed tables for each of our generators to $BMAT_BASIS_DIR:
+// G<N>.basis, the reconstruction basis, so secret and reconstructMatrix load it
+// rather than inverting a matrix on every run, and G<N>.comb, the fixed-base
+// comb table genkey uses to compute G^k without squarings.
+
+#define COMB_BITS 6 // Table entries per window are 2^COMB_BITS
+
+int main(int argc, char **argv)
+{
+    Matrix G;
+    Field F;
+    char *fileName;
+    int i, N;
+
+    if(argc != 1 || getGeneratorFile(2, "basis") == NULL) {
+        printf("Usage: BMAT_BASIS_DIR=<directory> genbasis\n");
+        return 1;
+    }
+    for(i = 0; i < getNumGenerators(); i++) {
+        N = getGeneratorSize(i);
+        G = getGenerator(N);
+        fileName = getGeneratorFile(N, "basis");
+        if(!writeReconstructionBasis(fileName, G)) {
+            return 1;
+        }
+        printf("Wrote %s\n", fileName);
+        F = createField(G);
+        if(F == NULL) {
+            continue;
+        }
+        buildCombTable(F, COMB_BITS);
+        fileName = getGeneratorFile(N, "comb");
+        if(!writeCombTable(F, fileName)) {
+            return 1;
+        }
+        printf("Wrote %s\n", fileName);
+        deleteField(F);
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "bmat.h"
 #include "generators.h"
 #include "G2.h"
@@ -17,21 +18,69 @@
 #include "G607.h"
 
 #define NUM_GENERATORS 14
+#define MAX_FILE_NAME 256
 static int generators[NUM_GENERATORS] =
 {2, 3, 5, 7, 13, 17, 19, 31, 61, 89, 107, 127, 521, 607};
 static uint64 *(generatorData[NUM_GENERATORS]) =
 {G2_data, G3_data, G5_data, G7_data, G13_data, G17_data, G19_data, G31_data,
 G61_data, G89_data, G107_data, G127_data, G521_data, G607_data};
 
-// Return the generator of size N or just larger.
+// Return the generator of size N or just larger.  If $BMAT_BASIS_DIR has a
+// basis file for it, written by genbasis, its reconstruction basis is loaded
+// rather than computed.
 Matrix getGenerator(int N)
 {
     uint64 *data = NULL;
+    Matrix G;
+    char *basisFile;
     int i;
 
     for(i = 0; i < NUM_GENERATORS && generators[i] < N; i++);
     N = generators[i];
     data = generatorData[i];
     initMatrixModule(N);
-    return allocateMatrix(createMatrix(data));
+    G = allocateMatrix(createMatrix(data));
+    basisFile = getGeneratorFile(N, "basis");
+    if(basisFile != NULL) {
+        readReconstructionBasis(basisFile, G);
+    }
+    return G;
+}
+
+// Return the name of a file of precomputed data for the N-bit generator, like
+// $BMAT_BASIS_DIR/G127.basis, or NULL if $BMAT_BASIS_DIR is not set.
+char *getGeneratorFile(int N, char *extension)
+{
+    static char fileName[MAX_FILE_NAME];
+    char *dir = getenv("BMAT_BASIS_DIR");
+
+    if(dir == NULL || *dir == '\0') {
+        return NULL;
+    }
+    snprintf(fileName, MAX_FILE_NAME, "%s/G%d.%s", dir, N, extension);
+    return fileName;
+}
+
+// Return the field of generator G, with its comb table loaded from
+// $BMAT_BASIS_DIR if genbasis wrote one.  Returns NULL if G has no field.
+Field getGeneratorField(Matrix G)
+{
+    Field F = createField(G);
+    char *combFile = getGeneratorFile(getMatrixSize(), "comb");
+
+    if(F != NULL && combFile != NULL) {
+        loadCombTable(F, combFile);
+    }
+    return F;
+}
+
+int getNumGenerators(void)
+{
+    return NUM_GENERATORS;
+}
+
+// Return the width of the index-th generator, smallest first.
+int getGeneratorSize(int index)
+{
+    return generators[index];
 }
@@ -1,2 +1,6 @@
 // Loads the generator and initiaizes Matrix module.
 Matrix getGenerator(int N);
+int getNumGenerators(void);
+int getGeneratorSize(int index);
+char *getGeneratorFile(int N, char *extension);
+Field getGeneratorField(Matrix G);
@@ -74,6 +74,7 @@ static Bignum createPrivateKeyFromKeyboard(
 int main(int argc, char **argv)
 {
     Matrix G, H;
+    Field F;
     Bignum privateKey, publicKey;
     Bignum readPrivateKey, readPublicKey;
     int N = 127;
@@ -103,8 +104,16 @@ int main(int argc, char **argv)
     } else {
         privateKey = createPrivateKeyFromKeyboard(N);
     }
-    H = matrixPow(G, privateKey);
-    publicKey = getMatrixRow(H, 0);
+    F = getGeneratorField(G);
+    setConstantTime(true); // Do not leak the private key through timing
+    if(F != NULL) {
+        // G^k is x^k in G's field, so only its first row is ever built.  With
+        // a comb table from genbasis, this takes no squarings.
+        publicKey = polyToRow(F, fieldPowX(F, privateKey));
+    } else {
+        H = matrixPow(G, privateKey);
+        publicKey = getMatrixRow(H, 0);
+    }
     sprintf(fileName, "id_%d.priv", N);
     if(!writeKey(fileName, privateKey, true)) {
         return 1;
@@ -1,14 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bmat.h"
 
 int main(int argc, char **argv)
 {
     Matrix G;
     int N;
+    int maxRowWeight = 0;
 
+    if(argc == 4 && !strcmp(argv[1], "-w")) {
+        maxRowWeight = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
     if(argc != 2) {
-        printf("Usage: genmatrix size\n");
+        printf("Usage: genmatrix [-w maxRowWeight] size\n"
+            "    -w : Search for a generator with at most maxRowWeight ones in each row\n");
         return 1;
     }
     N = atoi(argv[1]);
@@ -16,9 +24,13 @@ int main(int argc, char **argv)
         printf("size must be >= 2\n");
         return 1;
     }
+    if(maxRowWeight < 0 || maxRowWeight == 1) {
+        printf("maxRowWeight must be at least 2\n");
+        return 1;
+    }
     initMatrixModule(N);
     initRandomModule(true);
-    G = randomGoodMatrix();
+    G = randomSparseGoodMatrix(maxRowWeight);
     showMatrixInHex(G);
     return 0;
 }
@@ -2,13 +2,81 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
 #include "bmat.h"
 
 static int N; // Width of matrices.
 static int numWords; // How many uint64 words are in each row.
+// The bits of a row's last word that are columns of the matrix.  The rest are
+// always zero in matrices, but vectors read from key files can have them set.
+static uint64 lastWordMask;
+
+// Method of Four Russians tables: all 2^m4rmBits XOR combinations of m4rmBits rows.
+#define MAX_M4RM_BITS 8
+static int m4rmBits;
+static uint64 *m4rmTable;
+static MultiplyMethod multiplyMethod = MULTIPLY_AUTO;
+static EliminationMethod eliminationMethod = ELIMINATE_AUTO;
+
+// In constant-time mode, matrixMultiply and matrixPow never branch on or index
+// memory by secret bits, so their timing does not leak the private key.
+static bool constantTime;
+
+// Kernels compiled for exactly numWords words per row, if we have them.
+static FixedKernels *fixedKernels;
+static SimdLevel fixedKernelsLevel;
+
+// Cache sizes in bytes.  L2 sets the blocked multiply's tile sizes; L1 is only
+// reported, since tables small enough for L1 need bands so narrow that the extra
+// passes over A cost more than the misses they save.
+#define DEFAULT_L1_CACHE_SIZE (32 << 10)
+#define DEFAULT_L2_CACHE_SIZE (256 << 10)
+#define BLOCKED_TABLE_BITS 8
+#define MAX_BLOCKED_TABLES 4
+static int l1CacheSize, l2CacheSize;
+static int tileWords, tileRows, tablesPerPass;
+static uint64 *blockedTables;
+
+// Smaller matrices are multiplied on the calling thread.  Threads get at least
+// MIN_ROWS_PER_THREAD rows, which is the pool's chunk alignment, so N/64 threads
+// at most work on one multiply.
+#define MIN_PARALLEL_SIZE 256
+#define MIN_ROWS_PER_THREAD 64
+#define MASKED_ROWS 4 // Result rows built at once by the generic masked multiply
+typedef uint64 MaskVector __attribute__((vector_size(MASKED_ROWS*sizeof(uint64))));
+static uint64 *threadTables; // One M4RM table per thread, for multiplyThreaded
+static size_t threadTablesSize;
+// Elimination and vector products sync once per pivot or do little work per
+// row, so they only go parallel on much bigger matrices.
+#define MIN_PARALLEL_ELIMINATION 1024
+#define MIN_PARALLEL_VECTOR 4096
+
+// Matrices with fewer than N*N/MAX_SPARSE_DENSITY ones use the sparse kernels
+// when they are multiplied many times, as generators are.
+#define MAX_SPARSE_DENSITY 16
+
+// Window powers and signed window recodings use at most this many bits.
+#define MAX_WINDOW_BITS 7
+
+// Strassen-Winograd recurses on blocks until they are no wider than this.
+#define DEFAULT_STRASSEN_CROSSOVER 4096
+static int strassenCrossover = DEFAULT_STRASSEN_CROSSOVER;
+
+// The fixed-width kernels beat M4RM on every host only for rows this short, which
+// keep all their tables in L1.  Wider ones win or lose by host, so MULTIPLY_AUTO
+// leaves them to a tuning profile.
+#define MAX_AUTO_FIXED_WORDS 2
 
 static Matrix firstFreeMatrix; // I'll maintain a free list of matricies.
 
+// The reconstruction basis of the last generator passed to
+// getReconstructionBasis, which is the inverse of the matrix of first rows of
+// its powers.  basisInverse is NULL if that matrix is singular.
+#define BASIS_VERSION 1
+static Matrix basisGenerator, basisInverse;
+static int basisSize;
+static Matrix scratchMatrix; // For multiplies whose result overwrites an input
+
 // This table is for computing the parity of bits of 16-bit ints.
 byte parityTable[1 << 16];
 
@@ -21,6 +89,7 @@ static int queuePos;
 // Structure definitions
 struct MatrixStruct {
     Matrix nextMatrix;
+    Matrix transposed; // Cached by getTransposed, and owned by this matrix.
     uint64 power; // Written to matrices in hash table.
     uint64 data[1]; // Accessed by row*numWords + col/64
 };
@@ -30,15 +99,118 @@ struct HashTableStruct {
     Matrix *matrices;
 };
 
+struct SparseMatrixStruct {
+    int weight; // Number of one bits
+    int *rowStart; // Row r has columns[rowStart[r]] .. columns[rowStart[r + 1] - 1]
+    int *columns;
+};
+
 int getMatrixSize(void)
 {
     return N;
 }
 
+// Pick the M4RM table width k that minimizes the (2^k + rows)/k row XORs per
+// column.
+static int chooseM4RMBits(int rows)
+{
+    int bestK = 1;
+    double cost, bestCost = rows + 2.0;
+    int k;
+
+    for(k = 1; k <= MAX_M4RM_BITS && k <= rows; k++) {
+        cost = ((double)(1 << k) + rows)/k;
+        if(cost < bestCost) {
+            bestCost = cost;
+            bestK = k;
+        }
+    }
+    return bestK;
+}
+
 void setMatrixWidth(int width)
 {
     N = width;
     numWords = (N + 63)/64;
+    lastWordMask = (N & 0x3f) == 0? ~(uint64)0 : ((uint64)1 << (N & 0x3f)) - 1;
+    m4rmBits = chooseM4RMBits(N);
+}
+
+// Return the kernels specialized for this row width and SIMD level, or NULL.
+static inline FixedKernels *getKernels(void)
+{
+    if(fixedKernelsLevel != getSimdLevel()) {
+        fixedKernelsLevel = getSimdLevel();
+        fixedKernels = getFixedKernels(numWords, fixedKernelsLevel);
+    }
+    return fixedKernels;
+}
+
+void setMultiplyMethod(MultiplyMethod method)
+{
+    multiplyMethod = method;
+}
+
+MultiplyMethod getMultiplyMethod(void)
+{
+    return multiplyMethod;
+}
+
+char *getMultiplyMethodName(MultiplyMethod method)
+{
+    switch(method) {
+    case MULTIPLY_ROWXOR: return "rowxor";
+    case MULTIPLY_M4RM: return "m4rm";
+    case MULTIPLY_STRASSEN: return "strassen";
+    case MULTIPLY_FIXED: return "fixed";
+    case MULTIPLY_BLOCKED: return "blocked";
+    case MULTIPLY_THREADED: return "threaded";
+    case MULTIPLY_MASKED: return "masked";
+    default: return "auto";
+    }
+}
+
+void setEliminationMethod(EliminationMethod method)
+{
+    eliminationMethod = method;
+}
+
+EliminationMethod getEliminationMethod(void)
+{
+    return eliminationMethod;
+}
+
+char *getEliminationMethodName(EliminationMethod method)
+{
+    switch(method) {
+    case ELIMINATE_GAUSS_JORDAN: return "gaussjordan";
+    case ELIMINATE_FIXED: return "fixed";
+    case ELIMINATE_M4RI: return "m4ri";
+    default: return "auto";
+    }
+}
+
+// Return the fixed-width kernels if the elimination method asks for them.  On
+// one word rows they beat blocked elimination, which has no blocks to gain on.
+static FixedKernels *getEliminationKernels(void)
+{
+    if(eliminationMethod == ELIMINATE_FIXED ||
+            (eliminationMethod == ELIMINATE_AUTO && numWords == 1)) {
+        return getKernels();
+    }
+    return NULL;
+}
+
+// Turn constant-time mode on or off.  While it is on, every multiply uses the
+// masked method, whatever method is set.
+void setConstantTime(bool value)
+{
+    constantTime = value;
+}
+
+bool getConstantTime(void)
+{
+    return constantTime;
 }
 
 // Hash table functions.
@@ -87,6 +259,11 @@ static bool equal(Matrix A, Matrix B)
     return true;
 }
 
+bool matricesEqual(Matrix A, Matrix B)
+{
+    return equal(A, B);
+}
+
 static Matrix lookupInHashTable(HashTable hashTable, Matrix M)
 {
     Matrix otherM = hashTable->matrices[hashMatrix(M) % hashTable->size];
@@ -117,6 +294,7 @@ Matrix allocateMatrix(Matrix oldM)
         memcpy((void *)M, (void *)oldM, size);
     }
     M->nextMatrix = NULL;
+    M->transposed = NULL; // The copy builds its own view if needed
     return M;
 }
 
@@ -130,8 +308,19 @@ static void addToHashTable(HashTable hashTable, Matrix M)
     hashTable->matrices[index] = M;
 }
 
+// Free the cached transposed view of M, if it has one.  Anything that changes
+// the data of a matrix that may have a view must call this.
+static void dropTransposed(Matrix M)
+{
+    if(M->transposed != NULL) {
+        deleteMatrix(M->transposed);
+        M->transposed = NULL;
+    }
+}
+
 void deleteMatrix(Matrix M)
 {
+    dropTransposed(M);
     M->nextMatrix = firstFreeMatrix;
     firstFreeMatrix = M;
 }
@@ -158,6 +347,7 @@ static inline Matrix newMatrix(void)
     if(++queuePos == QUEUE_LEN) {
         queuePos = 0;
     }
+    dropTransposed(matrixQueue[queuePos]);
     return matrixQueue[queuePos];
 }
 
@@ -168,6 +358,7 @@ static inline Matrix copy(Matrix oldM)
     memcpy((void *)M, (void *)oldM,
         sizeof(struct MatrixStruct) + (N*numWords - 1)*sizeof(uint64));
     M->nextMatrix = NULL;
+    M->transposed = NULL;
     return M;
 }
 
@@ -194,6 +385,7 @@ static inline int getBit(Matrix M, int row, int col)
 static void setRow(Matrix A, int row, Bignum n)
 {
     memcpy(A->data + row*numWords, getBignumData(n), numWords*sizeof(uint64));
+    A->data[row*numWords + numWords - 1] &= lastWordMask;
 }
 
 Bignum getMatrixRow(Matrix A, int row)
@@ -204,17 +396,6 @@ Bignum getMatrixRow(Matrix A, int row)
     return n;
 }
 
-Bignum getMatrixColumn(Matrix A, int column)
-{
-    Bignum n = createBignum(0, N);
-    int i;
-
-    for(i = 0; i < N; i++) {
-        setBignumBit(n, i, getBit(A, i, column));
-    }
-    return n;
-}
-
 static Matrix zero(void)
 {
     Matrix M = newMatrix();
@@ -273,32 +454,65 @@ void showMatrixInHex(Matrix M)
     printf("};\n");
 }
 
-static Matrix rotate(Matrix M)
+// Transpose M into res, 64x64 bit blocks at a time.  Block (I, J) of M becomes
+// block (J, I) of res.  Rows past N are read as zeros, and not written.
+static void transposeInto(Matrix res, Matrix M)
 {
-    Matrix res = zero();
-    int row, col;
-
-    for(row = 0; row < N; row++) {
-        for(col = 0; col < N; col++) {
-            setBit(res, row, col, getBit(M, col, N - row - 1));
+    uint64 block[64];
+    int blockRow, blockCol, row, rows;
+
+    for(blockRow = 0; blockRow < numWords; blockRow++) {
+        rows = N - 64*blockRow < 64? N - 64*blockRow : 64;
+        for(blockCol = 0; blockCol < numWords; blockCol++) {
+            for(row = 0; row < 64; row++) {
+                block[row] = row < rows? M->data[(64*blockRow + row)*numWords + blockCol] : 0;
+            }
+            transposeBlock(block);
+            for(row = 0; row < 64 && 64*blockCol + row < N; row++) {
+                res->data[(64*blockCol + row)*numWords + blockRow] = block[row];
+            }
         }
     }
-    return res;
 }
 
 static Matrix transpose(Matrix M)
 {
     Matrix res = zero();
-    int row, col;
+
+    transposeInto(res, M);
+    return res;
+}
+
+// Return the transpose of M, computing it the first time it is asked for.  The
+// view belongs to M: it is freed with M, and must not be changed or deleted.
+Matrix getTransposed(Matrix M)
+{
+    if(M->transposed == NULL) {
+        M->transposed = allocateMatrix(NULL);
+        memset(M->transposed, 0, sizeof(struct MatrixStruct) + (N*numWords - 1)*sizeof(uint64));
+        transposeInto(M->transposed, M);
+    }
+    return M->transposed;
+}
+
+// Rotate M a quarter turn, which is the transpose with the rows reversed.
+static Matrix rotate(Matrix M)
+{
+    Matrix T = getTransposed(M);
+    Matrix res = zero();
+    int row;
 
     for(row = 0; row < N; row++) {
-        for(col = 0; col < N; col++) {
-            setBit(res, row, col, getBit(M, col, row));
-        }
+        memcpy(res->data + row*numWords, T->data + (N - row - 1)*numWords,
+            numWords*sizeof(uint64));
     }
     return res;
 }
 
+Bignum getMatrixColumn(Matrix A, int column)
+{
+    return getMatrixRow(getTransposed(A), column);
+}
 
 static Matrix add(Matrix A, Matrix B)
 {
@@ -316,78 +530,54 @@ static Matrix add(Matrix A, Matrix B)
 // Computes one value in matrix multiply, but N must be transposed.
 static inline int dotProd(Matrix A, Matrix B, int row, int col)
 {
-    uint64 *p = A->data + row*numWords;
-    uint64 *q = B->data + col*numWords;
-    uint64 v;
-    int value = 0;
-    int i;
-
-   
-    for(i = 0; i < numWords; i++) {
-        v = *p++ & *q++;
-        value ^= parityTable[(unsigned short)v] ^ parityTable[(unsigned short)(v >> 16)] ^
-            parityTable[(unsigned short)(v >> 32)] ^ parityTable[(unsigned short)(v >> 48)];
-    }
-    return value;
+    return dotProductWords(A->data + row*numWords, B->data + col*numWords, numWords);
 }
 
 static inline int dotProdVect(Matrix A, Bignum n, int row)
 {
-    uint64 *p = A->data + row*numWords;
-    uint64 word;
-    uint64 v;
-    int value = 0;
-    int i;
-
-   
-    for(i = 0; i < numWords; i++) {
-        word = getBignumWord(n, i);
-        v = *p++ & word;
-        value ^= parityTable[(unsigned short)v] ^ parityTable[(unsigned short)(v >> 16)] ^
-            parityTable[(unsigned short)(v >> 32)] ^ parityTable[(unsigned short)(v >> 48)];
-    }
-    return value;
+    return dotProductWords(A->data + row*numWords, getBignumData(n), numWords);
 }
 
 // This assumes B has been transposed, and is faster.
 static Matrix multiplyTransposed(Matrix A, Matrix B)
 {
     Matrix res = zero();
+    uint64 word;
     int row, col;
 
     for(row = 0; row < N; row++) {
+        word = 0;
         for(col = 0; col < N; col++) {
-            setBit(res, row, col, dotProd(A, B, row, col));
+            word |= (uint64)dotProd(A, B, row, col) << (col & 0x3f);
+            if((col & 0x3f) == 0x3f || col == N - 1) {
+                res->data[row*numWords + (col >> 6)] = word;
+                word = 0;
+            }
         }
     }
     return res;
 }
 
-// This is slower, since it has to transpose N first.
+// This is slower, since it has to transpose N first, but it uses B's cached
+// transposed view when there is one.
 Matrix matrixMultiplySlow(Matrix A, Matrix B)
 {
-    return multiplyTransposed(A, transpose(B));
+    return multiplyTransposed(A, getTransposed(B));
 }
 
 // XOR the source row into the dest row.
 static inline void xorMatrixRows(Matrix S, Matrix D, int source, int dest)
 {
-    uint64 *s = S->data + source*numWords;
-    uint64 *d = D->data + dest*numWords;
-    int i;
-
-    for(i = 0; i < numWords; i++) {
-        *d++ ^= *s++;
-    }
+    xorRowWords(D->data + dest*numWords, S->data + source*numWords, numWords);
 }
 
 // Another, hopefully faster multiply.
-Matrix matrixMultiply(Matrix A, Matrix B)
+static void multiplyRowXor(Matrix res, Matrix A, Matrix B)
 {
-    Matrix res = zero();
     uint64 word;
     int row, xWord, bit;
 
+    memset(res->data, 0, N*numWords*sizeof(uint64));
     for(row = 0; row < N; row++) {
         for(xWord = 0; xWord < numWords; xWord++) {
             word = A->data[row*numWords + xWord];
@@ -399,217 +589,1474 @@ Matrix matrixMultiply(Matrix A, Matrix B)
             }
         }
     }
-    return res;
 }
 
-// Xor the source row data onto the dest row data.
-static void xorRowData(
-    uint64 *sourceRow,
-    uint64 *destRow)
+// Return numBits bits of the row data, starting at column col.
+static inline unsigned getRowBits(uint64 *row, int col, int numBits)
 {
-    int i;
+    int word = col >> 6;
+    int bit = col & 0x3f;
+    uint64 value = row[word] >> bit;
 
-    for(i = 0; i < numWords; i++) {
-        *destRow++ ^= *sourceRow++;
+    if(bit + numBits > 64) {
+        value |= row[word + 1] << (64 - bit);
     }
+    return (unsigned)(value & (((uint64)1 << numBits) - 1));
 }
 
-// Multiply a vector on the left by a matrix on the right.
-Bignum vectorMultiplyMatrix(Bignum v, Matrix A)
+// Fill the table with all 2^numBits XOR combinations of rows firstRow,
+// firstRow + 1, ... of the row data.  Each row and table entry has the given
+// number of words, and rows are stride words apart.  Entries are visited in Gray
+// code order, so each one costs a single row XOR.
+static void buildM4RMTable(uint64 *table, uint64 *rows, int stride, int firstRow,
+    int numBits, int words)
 {
-    Bignum res = createBignum(0, getBignumSize(v));
-    int row;
-    uint64 *resData = getBignumData(res);
-    uint64 *AData = A->data;
+    unsigned i, gray, prevGray = 0;
+
+    memset(table, 0, words*sizeof(uint64));
+    for(i = 1; i < (1 << numBits); i++) {
+        gray = i ^ (i >> 1);
+        xorRowWords3(table + gray*words, table + prevGray*words,
+            rows + (firstRow + __builtin_ctz(i))*stride, words);
+        prevGray = gray;
+    }
+}
 
-    for(row = 0; row < N; row++) {
-        if(getBignumBit(v, row)) {
-            xorRowData(AData, resData);
+// Method of Four Russians multiply.  For each slice of k columns of A, we build
+// a table of all combinations of the matching k rows of B, and then each row of
+// the result needs only one table lookup and row XOR per slice, rather than one
+// per set bit.  This is about N^2/k row XORs rather than N^2/2.  This works on
+// raw row data: A is rows x innerBits, B is innerBits x words*64, and each
+// matrix has its own row stride, so it also multiplies sub-blocks.  The table
+// has room for 2^tableBits rows of words words, which caps the width we pick
+// for a partial block of rows.  If accumulate is true, the product is XORed
+// onto res rather than written over it.
+static void m4rmMultiplyData(uint64 *res, int resStride, uint64 *A, int AStride,
+    uint64 *B, int BStride, int rows, int innerBits, int words, uint64 *table,
+    int tableBits, bool accumulate)
+{
+    int k = rows == N? m4rmBits : chooseM4RMBits(rows);
+    uint64 *resRow;
+    unsigned index;
+    int row, col, numBits;
+
+    if(k > tableBits) {
+        k = tableBits;
+    }
+    for(col = 0; col < innerBits; col += k) {
+        numBits = innerBits - col < k? innerBits - col : k;
+        buildM4RMTable(table, B, BStride, col, numBits, words);
+        for(row = 0; row < rows; row++) {
+            index = getRowBits(A + row*AStride, col, numBits);
+            resRow = res + row*resStride;
+            if(col == 0 && !accumulate) {
+                memcpy(resRow, table + index*words, words*sizeof(uint64));
+            } else {
+                xorRowWords(resRow, table + index*words, words);
+            }
         }
-        AData += numWords;
     }
-    return res;
 }
 
-// Multiply a matrix by a Bignum vector.  We assum it's vertical and on the right.
-Bignum matrixMultiplyVector(Matrix A, Bignum n)
+static void multiplyM4RM(Matrix res, Matrix A, Matrix B)
+{
+    m4rmMultiplyData(res->data, numWords, A->data, numWords, B->data, numWords,
+        N, N, numWords, m4rmTable, m4rmBits, false);
+}
+
+// Set each row of the square dest block to the XOR of the rows of blocks a and b.
+static void addBlocks(uint64 *dest, int destStride, uint64 *a, int aStride,
+    uint64 *b, int bStride, int words)
 {
-    Bignum res = createBignum(0, getBignumSize(n));
     int row;
 
-    for(row = 0; row < N; row++) {
-        setBignumBit(res, row, dotProdVect(A, n, row));
+    for(row = 0; row < 64*words; row++) {
+        xorRowWords3(dest + row*destStride, a + row*aStride, b + row*bStride, words);
     }
-    return res;
 }
 
-// Compute M^n.
-Matrix matrixPow(
-    Matrix M,
-    Bignum n)
+// Strassen-Winograd multiply of square blocks of 64*words bits on a side, with
+// 7 half-size multiplies rather than 8.  Over GF(2), addition and subtraction
+// are both XOR.  Blocks at or below the crossover size use M4RM.  Each level
+// takes its four temporary blocks from the front of the workspace, and passes
+// the rest down to the next level.
+static void strassenMultiplyData(uint64 *C, int cStride, uint64 *A, int aStride,
+    uint64 *B, int bStride, int words, uint64 *workspace)
 {
-    Matrix res = identity();
-    int size = getBignumSize(n);
-    int i;
+    int h = words >> 1;
+    int hRows = 64*h;
+    uint64 *X, *Y, *Q, *R, *rest;
+    uint64 *A11, *A12, *A21, *A22, *B11, *B12, *B21, *B22;
+    uint64 *C11, *C12, *C21, *C22;
+
+    if(64*words <= strassenCrossover || (words & 1)) {
+        m4rmMultiplyData(C, cStride, A, aStride, B, bStride, 64*words, 64*words, words,
+            m4rmTable, m4rmBits, false);
+        return;
+    }
+    A11 = A; A12 = A + h; A21 = A + hRows*aStride; A22 = A21 + h;
+    B11 = B; B12 = B + h; B21 = B + hRows*bStride; B22 = B21 + h;
+    C11 = C; C12 = C + h; C21 = C + hRows*cStride; C22 = C21 + h;
+    X = workspace;
+    Y = X + hRows*h;
+    Q = Y + hRows*h;
+    R = Q + hRows*h;
+    rest = R + hRows*h;
+    addBlocks(X, h, A21, aStride, A22, aStride, h); // S1
+    addBlocks(Y, h, B12, bStride, B11, bStride, h); // T1
+    strassenMultiplyData(R, h, X, h, Y, h, h, rest); // P5 = S1*T1
+    addBlocks(X, h, X, h, A11, aStride, h); // S2 = S1 + A11
+    addBlocks(Y, h, B22, bStride, Y, h, h); // T2 = B22 + T1
+    strassenMultiplyData(Q, h, X, h, Y, h, h, rest); // P6 = S2*T2
+    addBlocks(X, h, A12, aStride, X, h, h); // S4 = A12 + S2
+    strassenMultiplyData(C12, cStride, X, h, B22, bStride, h, rest); // P3 = S4*B22
+    addBlocks(Y, h, Y, h, B21, bStride, h); // T4 = T2 + B21
+    strassenMultiplyData(C21, cStride, A22, aStride, Y, h, h, rest); // P4 = A22*T4
+    addBlocks(X, h, A11, aStride, A21, aStride, h); // S3
+    addBlocks(Y, h, B22, bStride, B12, bStride, h); // T3
+    strassenMultiplyData(C22, cStride, X, h, Y, h, h, rest); // P7 = S3*T3
+    strassenMultiplyData(X, h, A11, aStride, B11, bStride, h, rest); // P1
+    strassenMultiplyData(C11, cStride, A12, aStride, B21, bStride, h, rest); // P2
+    addBlocks(C11, cStride, C11, cStride, X, h, h); // U1 = P1 + P2
+    addBlocks(Q, h, Q, h, X, h, h); // U2 = P1 + P6
+    addBlocks(C22, cStride, C22, cStride, Q, h, h); // U3 = U2 + P7
+    addBlocks(Q, h, Q, h, R, h, h); // U4 = U2 + P5
+    addBlocks(C12, cStride, C12, cStride, Q, h, h); // U5 = U4 + P3
+    addBlocks(C21, cStride, C22, cStride, C21, cStride, h); // U6 = U3 + P4
+    addBlocks(C22, cStride, C22, cStride, R, h, h); // U7 = U3 + P5
+}
 
-    for(i = 0; i < size; i++) {
-        if(getBignumBit(n, i)) {
-            res = matrixMultiply(res, M);
-        }
-        M = matrixMultiply(M, M);
+// Strassen-Winograd needs square blocks that halve evenly down to the crossover
+// size, so we zero-pad A and B to c*2^L words wide, with c*64 <= the crossover.
+// The padded copies and the temporary blocks for every level are kept in one
+// buffer that is reused between calls.
+static void multiplyStrassen(Matrix res, Matrix A, Matrix B)
+{
+    static uint64 *buffer = NULL;
+    static size_t bufferSize = 0;
+    int levels = 0;
+    int baseWords = numWords;
+    int words, row;
+    size_t blockSize, size;
+    uint64 *a, *b, *c;
+
+    while(64*baseWords > strassenCrossover && baseWords > 1) {
+        baseWords = (baseWords + 1) >> 1;
+        levels++;
+    }
+    if(levels == 0) {
+        multiplyM4RM(res, A, B);
+        return;
+    }
+    words = baseWords << levels;
+    blockSize = (size_t)64*words*words;
+    // Each level needs four quarter-size blocks, which sums to under 4/3 of a block.
+    size = 3*blockSize + (4*blockSize)/3 + 1;
+    if(size > bufferSize) {
+        free(buffer);
+        buffer = (uint64 *)malloc(size*sizeof(uint64));
+        bufferSize = size;
+    }
+    a = buffer;
+    b = a + blockSize;
+    c = b + blockSize;
+    memset(a, 0, 2*blockSize*sizeof(uint64));
+    for(row = 0; row < N; row++) {
+        memcpy(a + row*words, A->data + row*numWords, numWords*sizeof(uint64));
+        memcpy(b + row*words, B->data + row*numWords, numWords*sizeof(uint64));
+    }
+    strassenMultiplyData(c, words, a, words, b, words, words, c + blockSize);
+    for(row = 0; row < N; row++) {
+        memcpy(res->data + row*numWords, c + row*words, numWords*sizeof(uint64));
     }
-    return res;
 }
 
-static byte xorSum(uint64 n)
+// Cache-blocked M4RM.  The result is computed in bands of tileWords columns, so
+// the 8-bit tables of B for a band fit in a quarter of L2, and in tiles of
+// tileRows rows, so the band of the result we keep revisiting stays in L2.  When
+// tables are narrow enough, tablesPerPass tables are applied on each pass over a
+// row.
+static void multiplyBlocked(Matrix res, Matrix A, Matrix B)
 {
-    byte value = 0;
+    int chunkBits = tablesPerPass*BLOCKED_TABLE_BITS;
+    int tableSize = (1 << BLOCKED_TABLE_BITS)*tileWords;
+    int firstWord, words, firstRow, rows, col, bits, numBits, numTables, row, t;
+    uint64 *resRow;
+    unsigned index;
+
+    for(firstWord = 0; firstWord < numWords; firstWord += tileWords) {
+        words = numWords - firstWord < tileWords? numWords - firstWord : tileWords;
+        for(firstRow = 0; firstRow < N; firstRow += tileRows) {
+            rows = N - firstRow < tileRows? N - firstRow : tileRows;
+            for(col = 0; col < N; col += chunkBits) {
+                bits = N - col < chunkBits? N - col : chunkBits;
+                numTables = (bits + BLOCKED_TABLE_BITS - 1)/BLOCKED_TABLE_BITS;
+                for(t = 0; t < numTables; t++) {
+                    numBits = bits - t*BLOCKED_TABLE_BITS;
+                    if(numBits > BLOCKED_TABLE_BITS) {
+                        numBits = BLOCKED_TABLE_BITS;
+                    }
+                    buildM4RMTable(blockedTables + t*tableSize, B->data + firstWord, numWords,
+                        col + t*BLOCKED_TABLE_BITS, numBits, words);
+                }
+                for(row = firstRow; row < firstRow + rows; row++) {
+                    index = getRowBits(A->data + row*numWords, col, bits);
+                    resRow = res->data + row*numWords + firstWord;
+                    if(col == 0) {
+                        memcpy(resRow, blockedTables + (index & 0xff)*words, words*sizeof(uint64));
+                        t = 1;
+                    } else {
+                        t = 0;
+                    }
+                    for(; t < numTables; t++) {
+                        xorRowWords(resRow, blockedTables + t*tableSize +
+                            ((index >> t*BLOCKED_TABLE_BITS) & 0xff)*words, words);
+                    }
+                }
+            }
+        }
+    }
+}
 
-    while(n != 0) {
-        if(n & 1) {
-            value ^= 1;
+typedef struct {
+    Matrix res, A, B;
+} MultiplyJob;
+
+// Multiply rows start .. end-1 of A by B, turning each bit of A into a mask
+// rather than branching on it.  Like the fixed-width kernels, this builds
+// MASKED_ROWS result rows at once, with word j of each of them in acc[j], so
+// one mask vector per bit of A covers them all.
+static void multiplyMaskedRows(void *context, int start, int end)
+{
+    MultiplyJob *job = (MultiplyJob *)context;
+    FixedKernels *kernels = getKernels();
+    uint64 *A = job->A->data;
+    uint64 *B = job->B->data;
+    MaskVector acc[numWords];
+    MaskVector words = {0};
+    MaskVector mask;
+    uint64 *BRow;
+    int row, rows, xWord, bit, numBits, r, j;
+
+    if(kernels != NULL) {
+        kernels->multiplyMasked(job->res->data + start*numWords, A + start*numWords, B,
+            end - start, N);
+        return;
+    }
+    for(row = start; row < end; row += MASKED_ROWS) {
+        rows = end - row < MASKED_ROWS? end - row : MASKED_ROWS;
+        memset(acc, 0, sizeof(acc));
+        BRow = B;
+        for(xWord = 0; xWord < numWords; xWord++) {
+            // Past the last row, reuse it rather than read beyond A.
+            for(r = 0; r < MASKED_ROWS; r++) {
+                words[r] = A[(row + (r < rows? r : 0))*numWords + xWord];
+            }
+            numBits = N - (xWord << 6) < 64? N - (xWord << 6) : 64;
+            for(bit = 0; bit < numBits; bit++) {
+                mask = -(words & 1);
+                words >>= 1;
+                for(j = 0; j < numWords; j++) {
+                    acc[j] ^= BRow[j] & mask;
+                }
+                BRow += numWords;
+            }
+        }
+        for(r = 0; r < rows; r++) {
+            for(j = 0; j < numWords; j++) {
+                job->res->data[(row + r)*numWords + j] = acc[j][r];
+            }
         }
-        n >>= 1;
     }
-    return value;
 }
 
-static void initParityTable(void)
+// A constant-time multiply.  Row ranges are public, so splitting by rows across
+// threads is still constant-time.
+static void multiplyMasked(Matrix res, Matrix A, Matrix B)
 {
-    unsigned i;
+    MultiplyJob job = {res, A, B};
 
-    for(i = 0; i < (1 << 16); i++) {
-        parityTable[i] = xorSum(i);
-    }
+    runInParallel(multiplyMaskedRows, &job, N, N < MIN_PARALLEL_SIZE? N : MIN_ROWS_PER_THREAD);
 }
 
-// Starts looking at row = pos, col = pos, and searches down.
-static int findNonZeroRow(Matrix M, int pos)
+// Multiply rows start .. end-1 of A by B, with this thread's table.
+static void multiplyRows(void *context, int start, int end)
 {
-    int row;
+    MultiplyJob *job = (MultiplyJob *)context;
+    uint64 *table = threadTables + (size_t)getThreadIndex()*(1 << m4rmBits)*numWords;
 
-    for(row = pos; row < N; row++) {
-        if(getBit(M, row, pos)) {
-            return row;
-        }
-    }
-    return -1;
+    m4rmMultiplyData(job->res->data + start*numWords, numWords, job->A->data + start*numWords,
+        numWords, job->B->data, numWords, end - start, N, numWords, table, m4rmBits, false);
 }
 
-// XOR the source row into the dest row.
-static inline void xorRow(Matrix M, int source, int dest)
+// Split the multiply by row ranges across the thread pool.  Each thread runs
+// M4RM on its rows, with its own table.  The tables are only reallocated when
+// the table size or the thread count grows.
+static void multiplyThreaded(Matrix res, Matrix A, Matrix B)
 {
-    uint64 *s = M->data + source*numWords;
-    uint64 *d = M->data + dest*numWords;
-    int i;
+    MultiplyJob job = {res, A, B};
+    size_t size = (size_t)getNumThreads()*(1 << m4rmBits)*numWords;
 
-    for(i = 0; i < numWords; i++) {
-        *d++ ^= *s++;
+    if(size > threadTablesSize) {
+        free(threadTables);
+        threadTables = (uint64 *)malloc(size*sizeof(uint64));
+        threadTablesSize = size;
     }
+
+    runInParallel(multiplyRows, &job, N, N < MIN_PARALLEL_SIZE? N : MIN_ROWS_PER_THREAD);
 }
 
-static bool isSingular(Matrix M)
+// Return the size of the data cache at the given level, from sysconf or sysfs.
+static int detectCacheSize(int level)
 {
-    Matrix A = copy(M);
-    int pos, row;
-
-    for(pos = 0; pos < N; pos++) {
-        row = findNonZeroRow(A, pos); // Starts looking at row = pos, col = pos
-        if(row == -1) {
-            return true;
+    char fileName[100];
+    FILE *file;
+    long size = sysconf(level == 1? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+    int index, fileLevel;
+    char type[20], units;
+
+    if(size > 0) {
+        return size;
+    }
+    for(index = 0; index < 8; index++) {
+        sprintf(fileName, "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        file = fopen(fileName, "r");
+        if(file == NULL) {
+            break;
         }
-        if(row > pos) {
-            xorRow(A, row, pos);
+        fileLevel = 0;
+        if(fscanf(file, "%d", &fileLevel) != 1) {
+            fileLevel = 0;
         }
-        for(row = pos + 1; row < N; row++) {
-            if(getBit(A, row, pos)) {
-                xorRow(A, pos, row);
+        fclose(file);
+        sprintf(fileName, "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        file = fopen(fileName, "r");
+        if(file == NULL || fscanf(file, "%19s", type) != 1) {
+            type[0] = '\0';
+        }
+        if(file != NULL) {
+            fclose(file);
+        }
+        if(fileLevel != level || !strcmp(type, "Instruction")) {
+            continue;
+        }
+        sprintf(fileName, "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        file = fopen(fileName, "r");
+        size = 0;
+        units = 'K';
+        if(file != NULL) {
+            if(fscanf(file, "%ld%c", &size, &units) < 1) {
+                size = 0;
             }
+            fclose(file);
+        }
+        if(size > 0) {
+            return units == 'M'? size << 20 : size << 10;
         }
     }
-    return false;
+    return level == 1? DEFAULT_L1_CACHE_SIZE : DEFAULT_L2_CACHE_SIZE;
 }
 
-// Matrix inverse with basic Gaussian elimination.
-// Start with A and I, and do Gaussian elimination to convert A to I,
-// while doing the same operations to the other matrix.
-Matrix inverse(Matrix M)
+// Choose the blocked multiply's tiles.  A set of tables gets a quarter of L2,
+// split into column bands if one full-width table would not fit, and the tile
+// of result rows being accumulated gets half of L2.
+static void chooseTileSizes(void)
 {
-    Matrix I = identity();
-    Matrix A = copy(M);
-    int row, lowerRow, upperRow;
+    int tableRowBytes = (1 << BLOCKED_TABLE_BITS)*sizeof(uint64);
 
-    // Do the row additions to zero out lower left of A
-    for(row = 0; row < N; row++) {
-        if(!getBit(A, row, row)) {
-            lowerRow = findNonZeroRow(A, row);
-            if(lowerRow == -1) {
-                printf("Matrix is singular\n");
-                return NULL;
-            }
-            xorRow(A, lowerRow, row);
-            xorRow(I, lowerRow, row);
-        }
-        for(lowerRow = row + 1; lowerRow < N; lowerRow++) {
-            if(getBit(A, lowerRow, row)) {
-                xorRow(A, row, lowerRow);
-                xorRow(I, row, lowerRow);
-            }
-        }
+    tileWords = (l2CacheSize/4)/tableRowBytes;
+    if(tileWords < 1) {
+        tileWords = 1;
     }
-    // Do the same thing to zero the upper part
-    for(row = N - 1; row >= 0; row--) {
-        for(upperRow = 0; upperRow < row; upperRow++) {
-            if(getBit(A, upperRow, row)) {
-                xorRow(A, row, upperRow);
-                xorRow(I, row, upperRow);
-            }
-        }
+    if(tileWords > numWords) {
+        tileWords = numWords;
     }
-    return I;
+    tablesPerPass = (l2CacheSize/4)/(tableRowBytes*tileWords);
+    if(tablesPerPass < 1) {
+        tablesPerPass = 1;
+    } else if(tablesPerPass > MAX_BLOCKED_TABLES) {
+        tablesPerPass = MAX_BLOCKED_TABLES;
+    }
+    tileRows = (l2CacheSize/2)/(tileWords*sizeof(uint64) + 64);
+    if(tileRows < 64) {
+        tileRows = 64;
+    }
+    free(blockedTables);
+    blockedTables = (uint64 *)malloc(tablesPerPass*tableRowBytes*tileWords);
 }
-    
-// Create a random Boolean matrix.
-static Matrix randomMatrix() 
+
+// Override the tile sizes chosen from the cache sizes.
+void setTileSizes(int words, int rows, int tables)
 {
-    Matrix M = zero();
-    int row, col;
+    tileWords = words < 1? 1 : words > numWords? numWords : words;
+    tileRows = rows < 1? 1 : rows;
+    tablesPerPass = tables < 1? 1 : tables > MAX_BLOCKED_TABLES? MAX_BLOCKED_TABLES : tables;
+    free(blockedTables);
+    blockedTables = (uint64 *)malloc(tablesPerPass*(1 << BLOCKED_TABLE_BITS)*tileWords*
+        sizeof(uint64));
+}
 
-    for(row = 0; row < N; row++) {
-        for(col = 0; col < N; col++) {
-            setBit(M, row, col, randomBool());
-        }
-    }
-    return M;
+// Override the detected cache sizes, in bytes.
+void setCacheSizes(int l1Size, int l2Size)
+{
+    l1CacheSize = l1Size;
+    l2CacheSize = l2Size;
+    chooseTileSizes();
 }
 
-// Create a random non-singular Boolean matrix.
-static Matrix randomNonSingularMatrix(void)
+void getCacheSizes(int *l1Size, int *l2Size)
 {
-    Matrix M, A;
-    int i = 0;
+    *l1Size = l1CacheSize;
+    *l2Size = l2CacheSize;
+}
 
-    while(true) {
-        M = randomMatrix();
-        i += 1;
-        if(!isSingular(M)) {
-            //printf("Generated non-signular matrix in %d tries\n", i);
-            A = add(M, identity());
-            if(!isSingular(A)) {
-                //printf("Found non-singular matrix with no eigan vectors in %d tries\n", i);
-                return M;
-            }
-        }
-    }
+// Report the blocked multiply's tile: words per band, rows per tile, and tables
+// applied per pass.
+void getTileSizes(int *words, int *rows, int *tables)
+{
+    *words = tileWords;
+    *rows = tileRows;
+    *tables = tablesPerPass;
 }
 
-// Find if sequence A, A^2, A^4, ... , A^(2^(N-1)) has unique elements, and that A^(2^N) == A.
-static bool hasGoodPowerOrder(Matrix A)
+void setStrassenCrossover(int size)
 {
-    Matrix M;
-    HashTable hashTable = createHashTable(N);
-    uint64 i;
-    bool passed;
+    strassenCrossover = size < 64? 64 : size;
+}
+
+// Matrices wider than this many bits are multiplied with Strassen-Winograd.
+int getStrassenCrossover(void)
+{
+    return strassenCrossover;
+}
+
+// Use M4RM tables of the given number of bits for full-size multiplies, rather
+// than the width chosen from N.
+void setM4RMBits(int bits)
+{
+    m4rmBits = bits < 1? 1 : bits > MAX_M4RM_BITS? MAX_M4RM_BITS : bits;
+    free(m4rmTable);
+    m4rmTable = (uint64 *)malloc((1 << m4rmBits)*numWords*sizeof(uint64));
+}
+
+int getM4RMBits(void)
+{
+    return m4rmBits;
+}
+
+// Return the method MULTIPLY_AUTO uses for this N: Strassen above the crossover,
+// threads if there are any, and otherwise the best kernel that fits in cache.
+static MultiplyMethod autoMethod(void)
+{
+    if(N > strassenCrossover) {
+        return MULTIPLY_STRASSEN;
+    } else if(N >= MIN_PARALLEL_SIZE && getNumThreads() > 1) {
+        return MULTIPLY_THREADED;
+    } else if(getKernels() != NULL && numWords <= MAX_AUTO_FIXED_WORDS) {
+        return MULTIPLY_FIXED;
+    } else if(N*numWords*sizeof(uint64) > l2CacheSize/2) {
+        return MULTIPLY_BLOCKED;
+    }
+    return MULTIPLY_M4RM;
+}
+
+// Compute A*B into res with the given method.  res must not be A or B.
+static void multiplyWithMethod(Matrix res, Matrix A, Matrix B, MultiplyMethod method)
+{
+    FixedKernels *kernels = getKernels();
+
+    switch(method) {
+    case MULTIPLY_AUTO:
+        multiplyWithMethod(res, A, B, autoMethod());
+        break;
+    case MULTIPLY_ROWXOR:
+        multiplyRowXor(res, A, B);
+        break;
+    case MULTIPLY_M4RM:
+        multiplyM4RM(res, A, B);
+        break;
+    case MULTIPLY_STRASSEN:
+        multiplyStrassen(res, A, B);
+        break;
+    case MULTIPLY_BLOCKED:
+        multiplyBlocked(res, A, B);
+        break;
+    case MULTIPLY_THREADED:
+        multiplyThreaded(res, A, B);
+        break;
+    case MULTIPLY_MASKED:
+        multiplyMasked(res, A, B);
+        break;
+    case MULTIPLY_FIXED:
+        if(kernels != NULL) {
+            kernels->multiply(res->data, A->data, B->data, N);
+        } else {
+            multiplyM4RM(res, A, B);
+        }
+        break;
+    }
+}
+
+// Return the multiply method to use.  Constant-time mode overrides the method
+// set by the caller or a tuning profile.
+static inline MultiplyMethod currentMethod(void)
+{
+    return constantTime? MULTIPLY_MASKED : multiplyMethod;
+}
+
+// Every multiply method writes all of res, so it does not need clearing first.
+Matrix matrixMultiply(Matrix A, Matrix B)
+{
+    Matrix res = newMatrix();
+
+    res->nextMatrix = NULL;
+    res->power = 0;
+    multiplyWithMethod(res, A, B, currentMethod());
+    return res;
+}
+
+// Set res to A*B, without using a temporary from the queue.  res may be A or B,
+// but then the product goes through a scratch matrix and is copied back, so
+// callers in hot loops should alternate between two destinations instead.
+void matrixMultiplyInto(Matrix res, Matrix A, Matrix B)
+{
+    dropTransposed(res);
+    if(res == A || res == B) {
+        multiplyWithMethod(scratchMatrix, A, B, currentMethod());
+        memcpy(res->data, scratchMatrix->data, N*numWords*sizeof(uint64));
+    } else {
+        multiplyWithMethod(res, A, B, currentMethod());
+    }
+}
+
+// Set res to A*A.  The fixed square kernel is used only where a multiply would
+// use the fixed kernels, so with MULTIPLY_AUTO squares go to the thread pool
+// or Strassen whenever multiplies do.
+void matrixSquareInto(Matrix res, Matrix A)
+{
+    FixedKernels *kernels = getKernels();
+    MultiplyMethod method = currentMethod();
+
+    if(method == MULTIPLY_AUTO) {
+        method = autoMethod();
+    }
+    if(res == A || kernels == NULL || method != MULTIPLY_FIXED) {
+        matrixMultiplyInto(res, A, A);
+        return;
+    }
+    dropTransposed(res);
+    kernels->square(res->data, A->data, N);
+}
+
+void matrixSquareInPlace(Matrix A)
+{
+    matrixMultiplyInto(A, A, A);
+}
+
+// XOR A*B onto res.  The plain M4RM path XORs the product straight into res; the
+// other methods build it in the scratch matrix first.  res must not be A or B.
+void matrixMultiplyAccumulate(Matrix res, Matrix A, Matrix B)
+{
+    MultiplyMethod method = currentMethod();
+    bool plainM4RM = method == MULTIPLY_M4RM ||
+        (method == MULTIPLY_AUTO && autoMethod() == MULTIPLY_M4RM);
+    int row;
+
+    dropTransposed(res);
+    if(plainM4RM) {
+        m4rmMultiplyData(res->data, numWords, A->data, numWords, B->data, numWords,
+            N, N, numWords, m4rmTable, m4rmBits, true);
+        return;
+    }
+    multiplyWithMethod(scratchMatrix, A, B, method);
+    for(row = 0; row < N; row++) {
+        xorRowWords(res->data + row*numWords, scratchMatrix->data + row*numWords, numWords);
+    }
+}
+
+// Exchange two matrix pointers, for loops that alternate between destinations.
+static inline void swapMatrices(Matrix *A, Matrix *B)
+{
+    Matrix temp = *A;
+
+    *A = *B;
+    *B = temp;
+}
+
+// Xor the source row data onto the dest row data.
+static void xorRowData(
+    uint64 *sourceRow,
+    uint64 *destRow)
+{
+    xorRowWords(destRow, sourceRow, numWords);
+}
+
+// Set res to v*A, turning each bit of v into a mask on its row of A rather than
+// branching on it.
+static void vectorMultiplyMasked(uint64 *res, uint64 *v, Matrix A)
+{
+    uint64 mask;
+    int row, j;
+
+    for(row = 0; row < N; row++) {
+        mask = (uint64)((long long)(v[row >> 6] << (63 - (row & 0x3f))) >> 63);
+        for(j = 0; j < numWords; j++) {
+            res[j] ^= A->data[row*numWords + j] & mask;
+        }
+    }
+}
+
+// Multiply a vector on the left by a matrix on the right.  In constant-time
+// mode v may be secret, such as the shared key in matrixPowRow, so we use masks
+// rather than skipping rows for zero bits.
+Bignum vectorMultiplyMatrix(Bignum v, Matrix A)
+{
+    Bignum res = createBignum(0, getBignumSize(v));
+    FixedKernels *kernels = getKernels();
+    int row;
+    uint64 *resData = getBignumData(res);
+    uint64 *AData = A->data;
+
+    if(constantTime) {
+        if(kernels != NULL) {
+            kernels->vectorMultiplyMasked(resData, getBignumData(v), AData, N);
+        } else {
+            vectorMultiplyMasked(resData, getBignumData(v), A);
+        }
+        return res;
+    }
+    if(kernels != NULL) {
+        kernels->vectorMultiply(resData, getBignumData(v), AData, N);
+        return res;
+    }
+    for(row = 0; row < N; row++) {
+        if(getBignumBit(v, row)) {
+            xorRowData(AData, resData);
+        }
+        AData += numWords;
+    }
+    return res;
+}
+
+typedef struct {
+    Matrix A;
+    Bignum n, res;
+} VectorJob;
+
+// Compute bits start .. end-1 of A*n.  Chunks start on multiples of 64, so
+// threads never write the same word of the result.
+static void multiplyVectorRows(void *context, int start, int end)
+{
+    VectorJob *job = (VectorJob *)context;
+    int row;
+
+    for(row = start; row < end; row++) {
+        setBignumBit(job->res, row, dotProdVect(job->A, job->n, row));
+    }
+}
+
+// Multiply a matrix by a Bignum vector.  We assum it's vertical and on the right.
+// If A has a transposed view, A*n is n times the view, which is just an XOR of
+// rows rather than N dot products.
+Bignum matrixMultiplyVector(Matrix A, Bignum n)
+{
+    Bignum res;
+    FixedKernels *kernels = getKernels();
+    VectorJob job;
+
+    if(A->transposed != NULL) {
+        return vectorMultiplyMatrix(n, A->transposed);
+    }
+    res = createBignum(0, getBignumSize(n));
+    job.A = A;
+    job.n = n;
+    job.res = res;
+    if(kernels != NULL) {
+        kernels->multiplyVector(getBignumData(res), A->data, getBignumData(n), N);
+        return res;
+    }
+    runInParallel(multiplyVectorRows, &job, N, N < MIN_PARALLEL_VECTOR? N : 1024);
+    return res;
+}
+
+// Sparse matrix functions.  Low weight generators are kept as a list of the
+// columns of their one bits, row by row, so a product with a dense matrix costs
+// one row XOR per one bit rather than a full dense multiply.
+
+// Return the number of one bits in M.
+int getMatrixWeight(Matrix M)
+{
+    int weight = 0;
+    int i;
+
+    for(i = 0; i < N*numWords; i++) {
+        weight += __builtin_popcountll(M->data[i]);
+    }
+    return weight;
+}
+
+// Return true if the sparse kernels beat a dense multiply with M.
+static bool isSparse(Matrix M)
+{
+    return getMatrixWeight(M) < N*N/MAX_SPARSE_DENSITY;
+}
+
+SparseMatrix createSparseMatrix(Matrix M)
+{
+    SparseMatrix S = (SparseMatrix)calloc(1, sizeof(struct SparseMatrixStruct));
+    uint64 word;
+    int row, i, pos = 0;
+
+    S->weight = getMatrixWeight(M);
+    S->rowStart = (int *)malloc((N + 1)*sizeof(int));
+    S->columns = (int *)malloc((S->weight + 1)*sizeof(int));
+    for(row = 0; row < N; row++) {
+        S->rowStart[row] = pos;
+        for(i = 0; i < numWords; i++) {
+            for(word = M->data[row*numWords + i]; word != 0; word &= word - 1) {
+                S->columns[pos++] = (i << 6) + __builtin_ctzll(word);
+            }
+        }
+    }
+    S->rowStart[N] = pos;
+    return S;
+}
+
+void deleteSparseMatrix(SparseMatrix S)
+{
+    free(S->rowStart);
+    free(S->columns);
+    free(S);
+}
+
+int getSparseMatrixWeight(SparseMatrix S)
+{
+    return S->weight;
+}
+
+// Return a sparse copy of M if it is sparse enough to be worth it, else NULL.
+SparseMatrix sparseFormOf(Matrix M)
+{
+    return isSparse(M)? createSparseMatrix(M) : NULL;
+}
+
+// Set res to S*B.  Row r of the result is the XOR of the rows of B selected by
+// the columns of row r of S.  res may be B.
+void sparseMultiplyInto(Matrix res, SparseMatrix S, Matrix B)
+{
+    Matrix dest = res == B? scratchMatrix : res;
+    uint64 *destRow = dest->data;
+    int row, i;
+
+    dropTransposed(res);
+    for(row = 0; row < N; row++) {
+        i = S->rowStart[row];
+        if(i == S->rowStart[row + 1]) {
+            memset(destRow, 0, numWords*sizeof(uint64));
+        } else {
+            memcpy(destRow, B->data + S->columns[i]*numWords, numWords*sizeof(uint64));
+            for(i++; i < S->rowStart[row + 1]; i++) {
+                xorRowWords(destRow, B->data + S->columns[i]*numWords, numWords);
+            }
+        }
+        destRow += numWords;
+    }
+    if(dest != res) {
+        memcpy(res->data, dest->data, N*numWords*sizeof(uint64));
+    }
+}
+
+Matrix sparseMultiply(SparseMatrix S, Matrix B)
+{
+    Matrix res = newMatrix();
+
+    res->nextMatrix = NULL;
+    res->power = 0;
+    sparseMultiplyInto(res, S, B);
+    return res;
+}
+
+// Multiply a vector on the left by a sparse matrix on the right, flipping one
+// result bit per one bit in the selected rows of S.
+Bignum vectorMultiplySparse(Bignum v, SparseMatrix S)
+{
+    Bignum res = createBignum(0, getBignumSize(v));
+    uint64 *resData = getBignumData(res);
+    uint64 *vData = getBignumData(v);
+    uint64 word;
+    int i, row, pos, col;
+
+    for(i = 0; i < numWords; i++) {
+        word = i == numWords - 1? vData[i] & lastWordMask : vData[i];
+        for(; word != 0; word &= word - 1) {
+            row = (i << 6) + __builtin_ctzll(word);
+            for(pos = S->rowStart[row]; pos < S->rowStart[row + 1]; pos++) {
+                col = S->columns[pos];
+                resData[col >> 6] ^= (uint64)1 << (col & 0x3f);
+            }
+        }
+    }
+    return res;
+}
+
+// Swap the data of A and B if mask is all ones, and leave them alone if it is
+// zero, without branching.
+static void conditionalSwap(Matrix A, Matrix B, uint64 mask)
+{
+    uint64 diff;
+    int i;
+
+    for(i = 0; i < N*numWords; i++) {
+        diff = (A->data[i] ^ B->data[i]) & mask;
+        A->data[i] ^= diff;
+        B->data[i] ^= diff;
+    }
+}
+
+// Compute M^n with a Montgomery ladder.  Every bit of n costs one multiply and
+// one square whatever its value, and the bit only selects a masked swap, so
+// neither the branches nor the memory accesses depend on n.  This works
+// because R0 and R1 are both powers of M, and so commute.
+static Matrix matrixPowLadder(Matrix M, Bignum n)
+{
+    Matrix R0 = allocateMatrix(identity());
+    Matrix R1 = allocateMatrix(M);
+    Matrix next0 = allocateMatrix(NULL);
+    Matrix next1 = allocateMatrix(NULL);
+    Matrix res;
+    uint64 bit, prevBit = 0;
+    int i;
+
+    for(i = getBignumSize(n) - 1; i >= 0; i--) {
+        bit = (getBignumWord(n, i >> 6) >> (i & 0x3f)) & 1;
+        // Swap when the bit is set, so R0*R1 and R0^2 always go in the same places.
+        conditionalSwap(R0, R1, -(bit ^ prevBit));
+        prevBit = bit;
+        matrixMultiplyInto(next1, R0, R1);
+        matrixSquareInto(next0, R0);
+        swapMatrices(&R0, &next0);
+        swapMatrices(&R1, &next1);
+    }
+    conditionalSwap(R0, R1, -prevBit);
+    res = copy(R0);
+    deleteMatrix(R0);
+    deleteMatrix(R1);
+    deleteMatrix(next0);
+    deleteMatrix(next1);
+    return res;
+}
+
+// Return the window width for sliding or fixed window powers with exponents
+// of this many bits.  Wider windows save multiplies, but their tables of
+// powers cost more to build, so they only pay off for longer exponents.
+int chooseWindowBits(int bits)
+{
+    if(bits > 671) {
+        return 6;
+    }
+    if(bits > 239) {
+        return 5;
+    }
+    if(bits > 79) {
+        return 4;
+    }
+    if(bits > 23) {
+        return 3;
+    }
+    return 1;
+}
+
+// Return the index of the highest set bit of n, or -1 if n is zero.
+static int topBit(Bignum n)
+{
+    int i;
+
+    for(i = getBignumSize(n) - 1; i >= 0 && !getBignumBit(n, i); i--);
+    return i;
+}
+
+// Compute M^n.  In constant-time mode, this uses the ladder.  Otherwise it
+// uses sliding windows: the exponent is cut into windows of at most
+// windowBits bits that start and end with a one, so each window costs one
+// multiply by an odd power of M from a small table, and runs of zeros cost
+// only squarings.  See matrixPowRecoded for signed windows.
+Matrix matrixPow(
+    Matrix M,
+    Bignum n)
+{
+    Matrix oddPowers[1 << (MAX_WINDOW_BITS - 1)];
+    Matrix res, next, square;
+    int i = topBit(n);
+    int windowBits = chooseWindowBits(i + 1);
+    int numOdd = 1 << (windowBits - 1);
+    int low, j;
+    unsigned value;
+    bool started = false;
+
+    if(constantTime) {
+        return matrixPowLadder(M, n);
+    }
+    // oddPowers[k] is M^(2k + 1).
+    oddPowers[0] = allocateMatrix(M);
+    if(numOdd > 1) {
+        square = allocateMatrix(NULL);
+        matrixSquareInto(square, M);
+        for(j = 1; j < numOdd; j++) {
+            oddPowers[j] = allocateMatrix(NULL);
+            matrixMultiplyInto(oddPowers[j], oddPowers[j - 1], square);
+        }
+        deleteMatrix(square);
+    }
+    // res alternates with next, so nothing is cleared or copied.
+    res = allocateMatrix(identity());
+    next = allocateMatrix(NULL);
+    while(i >= 0) {
+        if(!getBignumBit(n, i)) {
+            matrixSquareInto(next, res);
+            swapMatrices(&res, &next);
+            i--;
+            continue;
+        }
+        low = i - windowBits + 1 < 0? 0 : i - windowBits + 1;
+        while(!getBignumBit(n, low)) {
+            low++;
+        }
+        value = 0;
+        for(j = i; j >= low; j--) {
+            value = (value << 1) | getBignumBit(n, j);
+            if(started) {
+                matrixSquareInto(next, res);
+                swapMatrices(&res, &next);
+            }
+        }
+        if(started) {
+            matrixMultiplyInto(next, res, oddPowers[value >> 1]);
+            swapMatrices(&res, &next);
+        } else {
+            memcpy(res->data, oddPowers[value >> 1]->data, N*numWords*sizeof(uint64));
+            started = true;
+        }
+        i = low - 1;
+    }
+    M = copy(res);
+    deleteMatrix(res);
+    deleteMatrix(next);
+    for(j = 0; j < numOdd; j++) {
+        deleteMatrix(oddPowers[j]);
+    }
+    return M;
+}
+
+static byte xorSum(uint64 n)
+{
+    byte value = 0;
+
+    while(n != 0) {
+        if(n & 1) {
+            value ^= 1;
+        }
+        n >>= 1;
+    }
+    return value;
+}
+
+static void initParityTable(void)
+{
+    unsigned i;
+
+    for(i = 0; i < (1 << 16); i++) {
+        parityTable[i] = xorSum(i);
+    }
+}
+
+// Return the first row from startRow down with a one in column col, or -1.
+// This tests the word holding the column rather than calling getBit.
+static int findNonZeroRow(Matrix M, int startRow, int col)
+{
+    uint64 *word = M->data + startRow*numWords + (col >> 6);
+    uint64 mask = (uint64)1 << (col & 0x3f);
+    int row;
+
+    for(row = startRow; row < N; row++, word += numWords) {
+        if(*word & mask) {
+            return row;
+        }
+    }
+    return -1;
+}
+
+// XOR the source row into the dest row.
+static inline void xorRow(Matrix M, int source, int dest)
+{
+    xorRowWords(M->data + dest*numWords, M->data + source*numWords, numWords);
+}
+
+// Gaussian elimination one row at a time on A, returning its rank, or less than
+// N as soon as it is known to be singular if stopIfSingular is true.
+static int gaussianRank(Matrix A, bool stopIfSingular)
+{
+    int rank = 0;
+    int pos, row;
+
+    for(pos = 0; pos < N; pos++) {
+        row = findNonZeroRow(A, rank, pos);
+        if(row == -1) {
+            if(stopIfSingular) {
+                return rank;
+            }
+            continue;
+        }
+        if(row > rank) {
+            xorRow(A, row, rank);
+        }
+        for(row = rank + 1; row < N; row++) {
+            if(getBit(A, row, pos)) {
+                xorRow(A, rank, row);
+            }
+        }
+        rank++;
+    }
+    return rank;
+}
+
+typedef struct {
+    Matrix A, I;
+    int pivot;
+} EliminationJob;
+
+// Clear the pivot column in rows start .. end-1, other than the pivot row, doing
+// the same row operations on I.
+static void eliminateRows(void *context, int start, int end)
+{
+    EliminationJob *job = (EliminationJob *)context;
+    int pivot = job->pivot;
+    int row;
+
+    for(row = start; row < end; row++) {
+        if(row != pivot && getBit(job->A, row, pivot)) {
+            xorRow(job->A, pivot, row);
+            xorRow(job->I, pivot, row);
+        }
+    }
+}
+
+// Matrix inverse with basic Gauss-Jordan elimination.
+// Start with A and I, and do Gaussian elimination to convert A to I,
+// while doing the same operations to the other matrix.  On big matrices,
+// clearing each pivot column is split by row ranges across the thread pool.
+// Returns false if A is singular.
+static bool gaussJordanInverse(Matrix A, Matrix I)
+{
+    EliminationJob job = {A, I, 0};
+    int row, lowerRow;
+
+    for(row = 0; row < N; row++) {
+        if(!getBit(A, row, row)) {
+            lowerRow = findNonZeroRow(A, row, row);
+            if(lowerRow == -1) {
+                return false;
+            }
+            xorRow(A, lowerRow, row);
+            xorRow(I, lowerRow, row);
+        }
+        job.pivot = row;
+        runInParallel(eliminateRows, &job, N, N < MIN_PARALLEL_ELIMINATION? N : 128);
+    }
+    return true;
+}
+
+// Blocked elimination, as in M4RI: pivots for a block of m4rmBits columns are
+// found first, and then every other row is cleared in that block with one
+// lookup in a Gray code table of XOR combinations of the pivot rows, rather
+// than one row XOR per pivot.  Rows firstPivot .. firstPivot + numPivots - 1
+// hold the block's pivots, which are reduced against each other, so a row's
+// bits in the pivot columns are exactly the combination that clears them.
+typedef struct {
+    Matrix A, I;
+    uint64 *tableA, *tableI;
+    int pivotColumns[MAX_M4RM_BITS];
+    int col, numBits, firstPivot, numPivots;
+} BlockEliminationJob;
+
+// Return the index into the pivot row tables that clears the pivot columns of
+// this row.
+static inline unsigned getPivotIndex(BlockEliminationJob *job, uint64 *row)
+{
+    unsigned bits = getRowBits(row, job->col, job->numBits);
+    unsigned index = 0;
+    int j;
+
+    for(j = 0; j < job->numPivots; j++) {
+        index |= ((bits >> (job->pivotColumns[j] - job->col)) & 1) << j;
+    }
+    return index;
+}
+
+// Clear the block's pivot columns in rows start .. end-1, other than the pivot
+// rows.  Without I, only rows below the pivots need it.
+static void eliminateBlockRows(void *context, int start, int end)
+{
+    BlockEliminationJob *job = (BlockEliminationJob *)context;
+    unsigned index;
+    int row;
+
+    for(row = start; row < end; row++) {
+        if(row < job->firstPivot + job->numPivots && (job->I == NULL || row >= job->firstPivot)) {
+            continue;
+        }
+        index = getPivotIndex(job, job->A->data + row*numWords);
+        if(index != 0) {
+            xorRowWords(job->A->data + row*numWords, job->tableA + index*numWords, numWords);
+            if(job->I != NULL) {
+                xorRowWords(job->I->data + row*numWords, job->tableI + index*numWords, numWords);
+            }
+        }
+    }
+}
+
+// Swap rows a and b of M.
+static void swapRows(Matrix M, int a, int b)
+{
+    uint64 *rowA = M->data + a*numWords;
+    uint64 *rowB = M->data + b*numWords;
+    uint64 temp;
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        temp = rowA[i];
+        rowA[i] = rowB[i];
+        rowB[i] = temp;
+    }
+}
+
+// Find the pivots of the block of columns col .. col + numBits - 1, from row
+// job->firstPivot down, and move them up to the pivot rows.  The search only
+// needs each candidate's bits in the block, reduced by the pivots found so far,
+// which fit in a word, so no row XORs are spent on rows that are not pivots.
+static void findBlockPivots(BlockEliminationJob *job)
+{
+    Matrix A = job->A, I = job->I;
+    unsigned pivotBits[MAX_M4RM_BITS];
+    unsigned bits = 0;
+    int c, j, row, pivot;
+
+    job->numPivots = 0;
+    for(c = 0; c < job->numBits; c++) {
+        pivot = job->firstPivot + job->numPivots;
+        for(row = pivot; row < N; row++) {
+            bits = getRowBits(A->data + row*numWords, job->col, job->numBits);
+            for(j = 0; j < job->numPivots; j++) {
+                if((bits >> (job->pivotColumns[j] - job->col)) & 1) {
+                    bits ^= pivotBits[j];
+                }
+            }
+            if((bits >> c) & 1) {
+                break;
+            }
+        }
+        if(row == N) {
+            continue;
+        }
+        if(row != pivot) {
+            swapRows(A, row, pivot);
+            if(I != NULL) {
+                swapRows(I, row, pivot);
+            }
+        }
+        // Reduce the new pivot by the others, and clear its column from them.
+        for(j = 0; j < job->numPivots; j++) {
+            if(getBit(A, pivot, job->pivotColumns[j])) {
+                xorRow(A, job->firstPivot + j, pivot);
+                if(I != NULL) {
+                    xorRow(I, job->firstPivot + j, pivot);
+                }
+            }
+        }
+        for(j = 0; j < job->numPivots; j++) {
+            if(getBit(A, job->firstPivot + j, job->col + c)) {
+                xorRow(A, pivot, job->firstPivot + j);
+                if(I != NULL) {
+                    xorRow(I, pivot, job->firstPivot + j);
+                }
+                pivotBits[j] ^= bits;
+            }
+        }
+        pivotBits[job->numPivots] = bits;
+        job->pivotColumns[job->numPivots++] = job->col + c;
+    }
+}
+
+// Blocked Gaussian elimination on A, returning its rank, or less than N as soon
+// as it is known to be singular if stopIfSingular is true.  If I is not NULL, A
+// is fully reduced, and the same row operations are done to I, so if I starts
+// as the identity and A is non-singular, I ends up as the inverse of A.
+static int m4riEliminate(Matrix A, Matrix I, bool stopIfSingular)
+{
+    BlockEliminationJob job;
+    int k = m4rmBits;
+    int rank = 0;
+
+    job.A = A;
+    job.I = I;
+    job.tableA = (uint64 *)malloc(((size_t)1 << k)*numWords*sizeof(uint64));
+    job.tableI = I == NULL? NULL : (uint64 *)malloc(((size_t)1 << k)*numWords*sizeof(uint64));
+    for(job.col = 0; job.col < N; job.col += k) {
+        job.numBits = N - job.col < k? N - job.col : k;
+        job.firstPivot = rank;
+        findBlockPivots(&job);
+        rank += job.numPivots;
+        if(stopIfSingular && job.numPivots < job.numBits) {
+            break;
+        }
+        if(job.numPivots == 0) {
+            continue;
+        }
+        buildM4RMTable(job.tableA, A->data, numWords, job.firstPivot, job.numPivots, numWords);
+        if(I != NULL) {
+            buildM4RMTable(job.tableI, I->data, numWords, job.firstPivot, job.numPivots, numWords);
+        }
+        runInParallel(eliminateBlockRows, &job, N, N < MIN_PARALLEL_ELIMINATION? N : 128);
+    }
+    free(job.tableA);
+    free(job.tableI);
+    return rank;
+}
+
+bool isSingular(Matrix M)
+{
+    Matrix A = copy(M);
+    FixedKernels *kernels = getEliminationKernels();
+
+    if(kernels != NULL) {
+        return kernels->eliminate(A->data, NULL, N) < N;
+    }
+    if(eliminationMethod == ELIMINATE_GAUSS_JORDAN) {
+        return gaussianRank(A, true) < N;
+    }
+    return m4riEliminate(A, NULL, true) < N;
+}
+
+// Return the rank of M over GF(2).
+int getMatrixRank(Matrix M)
+{
+    Matrix A = copy(M);
+    FixedKernels *kernels = getEliminationKernels();
+
+    if(kernels != NULL) {
+        return kernels->eliminate(A->data, NULL, N);
+    }
+    if(eliminationMethod == ELIMINATE_GAUSS_JORDAN) {
+        return gaussianRank(A, false);
+    }
+    return m4riEliminate(A, NULL, false);
+}
+
+// Return the inverse of M, or NULL if it is singular.
+Matrix inverse(Matrix M)
+{
+    Matrix I = identity();
+    Matrix A = copy(M);
+    FixedKernels *kernels = getEliminationKernels();
+    bool invertible;
+
+    if(kernels != NULL) {
+        invertible = kernels->eliminate(A->data, I->data, N) == N;
+    } else if(eliminationMethod == ELIMINATE_GAUSS_JORDAN) {
+        invertible = gaussJordanInverse(A, I);
+    } else {
+        invertible = m4riEliminate(A, I, true) == N;
+    }
+    if(!invertible) {
+        printf("Matrix is singular\n");
+        return NULL;
+    }
+    return I;
+}
+
+// A width w NAF of an exponent: signed odd digits below 2^(w-1) in absolute
+// value, with at least w - 1 zeros after each nonzero digit.
+struct RecodedExponentStruct {
+    int length;
+    int windowBits;
+    signed char digits[1]; // digits[i] is the digit of 2^i
+};
+
+// Recode n as a width windowBits NAF, for matrixPowRecoded.  A private key that
+// is used for many powers only needs recoding once.
+RecodedExponent recodeExponent(Bignum n, int windowBits)
+{
+    int size = getBignumSize(n);
+    int length = size + 1; // Negative digits can carry one bit past the top
+    RecodedExponent e = (RecodedExponent)calloc(1, sizeof(struct RecodedExponentStruct) + length);
+    byte *bits;
+    int i, j, digit;
+
+    if(windowBits < 2) {
+        windowBits = 2;
+    } else if(windowBits > MAX_WINDOW_BITS) {
+        windowBits = MAX_WINDOW_BITS;
+    }
+    bits = (byte *)calloc(length + windowBits, sizeof(byte));
+    for(i = 0; i < size; i++) {
+        bits[i] = getBignumBit(n, i);
+    }
+    e->length = length;
+    e->windowBits = windowBits;
+    i = 0;
+    while(i < length) {
+        if(!bits[i]) {
+            i++;
+            continue;
+        }
+        // The digit is the low windowBits bits, taken as a signed value, which
+        // leaves windowBits zeros once it is subtracted.
+        digit = 0;
+        for(j = windowBits - 1; j >= 0; j--) {
+            digit = (digit << 1) | bits[i + j];
+            bits[i + j] = 0;
+        }
+        if(digit >= 1 << (windowBits - 1)) {
+            digit -= 1 << windowBits;
+            for(j = i + windowBits; bits[j]; j++) {
+                bits[j] = 0;
+            }
+            bits[j] = 1;
+        }
+        e->digits[i] = digit;
+        i += windowBits;
+    }
+    free(bits);
+    return e;
+}
+
+void deleteRecodedExponent(RecodedExponent e)
+{
+    free(e);
+}
+
+// Compute M^n, given n recoded by recodeExponent.  Negative digits multiply by
+// odd powers of M^-1, so a width w NAF needs 2^(w-2) powers each of M and
+// M^-1, for one nonzero digit in w + 1 on average.  That is the same table size
+// and density as matrixPow's sliding windows, plus an inverse, so matrixPow
+// does not use this.  Return NULL if M is singular.
+Matrix matrixPowRecoded(
+    Matrix M,
+    RecodedExponent e)
+{
+    Matrix positive[1 << (MAX_WINDOW_BITS - 2)], negative[1 << (MAX_WINDOW_BITS - 2)];
+    Matrix square, res, next, *table;
+    int numOdd = e->windowBits < 2? 1 : 1 << (e->windowBits - 2);
+    int i, j, digit;
+    bool started = false;
+
+    // positive[k] is M^(2k + 1), and negative[k] is M^-(2k + 1).
+    positive[0] = allocateMatrix(M);
+    negative[0] = inverse(positive[0]);
+    if(negative[0] == NULL) {
+        deleteMatrix(positive[0]);
+        return NULL;
+    }
+    negative[0] = allocateMatrix(negative[0]);
+    square = allocateMatrix(NULL);
+    for(table = positive; table != NULL; table = table == positive? negative : NULL) {
+        if(numOdd > 1) {
+            matrixSquareInto(square, table[0]);
+        }
+        for(j = 1; j < numOdd; j++) {
+            table[j] = allocateMatrix(NULL);
+            matrixMultiplyInto(table[j], table[j - 1], square);
+        }
+    }
+    res = allocateMatrix(identity());
+    next = square;
+    for(i = e->length - 1; i >= 0; i--) {
+        if(started) {
+            matrixSquareInto(next, res);
+            swapMatrices(&res, &next);
+        }
+        digit = e->digits[i];
+        if(digit == 0) {
+            continue;
+        }
+        table = digit > 0? positive : negative;
+        digit = digit > 0? digit : -digit;
+        if(started) {
+            matrixMultiplyInto(next, res, table[digit >> 1]);
+            swapMatrices(&res, &next);
+        } else {
+            memcpy(res->data, table[digit >> 1]->data, N*numWords*sizeof(uint64));
+            started = true;
+        }
+    }
+    M = copy(res);
+    deleteMatrix(res);
+    deleteMatrix(next);
+    for(j = 0; j < numOdd; j++) {
+        deleteMatrix(positive[j]);
+        deleteMatrix(negative[j]);
+    }
+    return M;
+}
+
+// Create a random Boolean matrix.
+static Matrix randomMatrix() 
+{
+    Matrix M = zero();
+    int row, col;
+
+    for(row = 0; row < N; row++) {
+        for(col = 0; col < N; col++) {
+            setBit(M, row, col, randomBool());
+        }
+    }
+    return M;
+}
+
+// Create a random Boolean matrix with at most maxRowWeight ones in each row.
+// The weights have to vary: if every row had the same even weight, M would be
+// singular, and if odd, M + I would be.
+static Matrix randomSparseMatrix(int maxRowWeight)
+{
+    Matrix M = zero();
+    int row, i;
+
+    for(row = 0; row < N; row++) {
+        for(i = 0; i < maxRowWeight; i++) {
+            setBit(M, row, randomUint64() % N, 1);
+        }
+    }
+    return M;
+}
+
+// Create a random non-singular Boolean matrix.  If maxRowWeight is not zero,
+// rows have at most maxRowWeight ones.
+static Matrix randomNonSingularMatrix(int maxRowWeight)
+{
+    Matrix M, A;
+    int i = 0;
+
+    while(true) {
+        M = maxRowWeight == 0? randomMatrix() : randomSparseMatrix(maxRowWeight);
+        i += 1;
+        if(!isSingular(M)) {
+            //printf("Generated non-signular matrix in %d tries\n", i);
+            A = add(M, identity());
+            if(!isSingular(A)) {
+                //printf("Found non-singular matrix with no eigan vectors in %d tries\n", i);
+                return M;
+            }
+        }
+    }
+}
+
+// Find if sequence A, A^2, A^4, ... , A^(2^(N-1)) has unique elements, and that A^(2^N) == A,
+// by squaring matrices.
+static bool hasGoodPowerOrderSlow(Matrix A)
+{
+    Matrix M;
+    HashTable hashTable = createHashTable(N);
+    uint64 i;
+    bool passed;
 
     A = allocateMatrix(A);
     if(isSingular(A)) {
@@ -625,24 +2072,140 @@ static bool hasGoodPowerOrder(Matrix A)
         addToHashTable(hashTable, M);
         M = matrixMultiply(M, M);
     }
-    passed = equal(M, A);
-    if(isSingular(A)) {
-        printf("Bug in finding non-singular matrix at %lld!\n", i);
+    passed = equal(M, A);
+    if(isSingular(A)) {
+        printf("Bug in finding non-singular matrix at %lld!\n", i);
+    }
+    delHashTable(hashTable);
+    deleteMatrix(A);
+    return passed;
+}
+
+// Find if sequence A, A^2, A^4, ... , A^(2^(N-1)) has unique elements, and that A^(2^N) == A.
+// Every A^(2^i) is a polynomial in A, so when C, whose row i is the first row of
+// A^i, is non-singular, the first rows determine the matrices, and the chain
+// of first rows is just repeated products with A's squaring map.  Since the
+// chain repeats with a period dividing N once A^(2^N) == A, the elements are
+// unique if none before A^(2^N) equals A.
+static bool hasGoodPowerOrder(Matrix A)
+{
+    Matrix C, Q;
+    Bignum e0, first, row, next;
+    int i;
+    bool passed = true;
+
+    e0 = createBignum(1, N);
+    C = krylovMatrix(A, e0);
+    deleteBignum(e0);
+    if(isSingular(C)) {
+        return hasGoodPowerOrderSlow(A);
+    }
+    Q = allocateMatrix(squaringMap(A, inverse(C)));
+    first = getMatrixRow(A, 0);
+    row = vectorMultiplyMatrix(first, Q);
+    for(i = 1; i < N && passed; i++) {
+        passed = !bignumsEqual(row, first);
+        next = vectorMultiplyMatrix(row, Q);
+        deleteBignum(row);
+        row = next;
     }
-    delHashTable(hashTable);
-    deleteMatrix(A);
+    passed = passed && bignumsEqual(row, first);
+    deleteBignum(first);
+    deleteBignum(row);
+    deleteMatrix(Q);
     return passed;
 }
 
+// Return true if A's characteristic polynomial is irreducible.  Then every
+// non-zero vector has it as its minimal polynomial, and otherwise e0's minimal
+// polynomial either has degree less than N, or is the characteristic polynomial
+// and is reducible, so one Krylov sequence from e0 decides it, and usually
+// stops early.
+static bool hasIrreducibleCharacteristic(Matrix A)
+{
+    Bignum e0 = createBignum(1, N);
+    Bignum p = vectorMinimalPolynomial(A, e0);
+    bool irreducible = polyDegree(p) == N && isIrreducible(p);
+
+    deleteBignum(e0);
+    deleteBignum(p);
+    return irreducible;
+}
+
+// Return the companion matrix C of f, which has degree N.  Row i is e(i+1) for
+// i < N - 1, and the last row is x^N mod f, f's low coefficients, so C acts on
+// row vectors as multiplication by x modulo f, and f is its characteristic
+// polynomial.
+static Matrix companionMatrix(Bignum f)
+{
+    Matrix C = zero();
+    int row;
+
+    for(row = 0; row < N - 1; row++) {
+        setBit(C, row, row + 1, 1);
+    }
+    for(row = 0; row < N; row++) {
+        setBit(C, N - 1, row, getBignumBit(f, row));
+    }
+    return C;
+}
+
 // By "good", I mean the exponents A, A^2, A^4, ... A^(2^(N-1)) are unique, and
 // A^(2^N) == A.
 Matrix randomGoodMatrix(void)
+{
+    return randomSparseGoodMatrix(0);
+}
+
+// Build a good matrix directly, as P^-1*C*P, where C is the companion matrix of
+// a random irreducible polynomial f, and P is a random non-singular matrix.
+// The matrices with characteristic polynomial f are exactly the conjugates of
+// C, and there are as many for every irreducible f, since the matrices
+// commuting with C form a copy of GF(2^N).  So this gives the same matrices,
+// with the same odds, as testing random matrices until one has an irreducible
+// characteristic polynomial, but the only loops are over polynomials, which
+// are cheap to test, and over P, which is non-singular about 29% of the time.
+static Matrix constructGoodMatrix(void)
+{
+    Bignum f = randomIrreduciblePolynomial(N);
+    Matrix C = allocateMatrix(companionMatrix(f));
+    Matrix P, PInverse, T, A;
+
+    do {
+        P = randomMatrix();
+    } while(isSingular(P));
+    P = allocateMatrix(P);
+    PInverse = allocateMatrix(inverse(P));
+    T = allocateMatrix(matrixMultiply(PInverse, C));
+    matrixMultiplyInto(C, T, P);
+    A = copy(C);
+    deleteMatrix(C);
+    deleteMatrix(P);
+    deleteMatrix(PInverse);
+    deleteMatrix(T);
+    deleteBignum(f);
+    return A;
+}
+
+// Find a good matrix with at most maxRowWeight ones in each row, or any weight
+// if maxRowWeight is zero, in which case we build it directly.  Low weight
+// generators let the sparse kernels do the products with G, but conjugation
+// would make them dense, so those we search for.  Candidates are accepted when
+// their characteristic polynomial f is irreducible: then A generates the field
+// GF(2^N), so A^(2^N) == A, and A is in no smaller subfield, so the A^(2^i) are
+// unique.  When N is prime, as for our generators, the converse holds too for
+// non-singular A and A + I, so this finds the same matrices as
+// hasGoodPowerOrder, at the cost of a Krylov sequence rather than N squarings.
+Matrix randomSparseGoodMatrix(int maxRowWeight)
 {
     Matrix A;
 
+    if(maxRowWeight == 0) {
+        return constructGoodMatrix();
+    }
     while(true) {
-        A = randomNonSingularMatrix();
-        if(hasGoodPowerOrder(A)) {
+        A = randomSparseMatrix(maxRowWeight);
+        if(hasIrreducibleCharacteristic(A)) {
             return A;
         }
     }
@@ -656,9 +2219,11 @@ static uint64 findCycleLength(Matrix A, uint64 maxCycle)
     uint64 stepSize = (uint64)(sqrt((double)maxCycle) + 0.5);
     uint64 numSteps = (uint64)(maxCycle/stepSize);
     Matrix K = allocateMatrix(matrixPow(A, createBignum(stepSize, 64)));
-    Matrix M = K;
+    Matrix M = allocateMatrix(K);
+    Matrix next = allocateMatrix(NULL);
     Matrix otherM;
     HashTable hashTable = createHashTable(numSteps);
+    SparseMatrix S = sparseFormOf(A);
     uint64 i, power, lowestPower;
     bool foundCollision = false;
     bool foundHit = false;
@@ -677,9 +2242,10 @@ static uint64 findCycleLength(Matrix A, uint64 maxCycle)
         } else {
             addToHashTable(hashTable, M);
         }
-        M = matrixMultiply(M, K);
+        matrixMultiplyInto(next, M, K);
+        swapMatrices(&M, &next);
     }
-    M = identity();
+    memcpy(M->data, identity()->data, N*numWords*sizeof(uint64));
     //printf("Looking for hit.\n");
     lowestPower = -1;
     for(i = 0; i < stepSize; i++) {
@@ -700,7 +2266,12 @@ static uint64 findCycleLength(Matrix A, uint64 maxCycle)
         }
         //printf("i is %d\n", i);
         //show(M);
-        M = matrixMultiply(M, A);
+        if(S != NULL) {
+            sparseMultiplyInto(next, S, M); // M is a power of A, so M*A == A*M
+        } else {
+            matrixMultiplyInto(next, M, A);
+        }
+        swapMatrices(&M, &next);
     }
     if(!foundHit) {
         printf("Looks like no loops below %lld\n", maxCycle);
@@ -712,14 +2283,26 @@ static uint64 findCycleLength(Matrix A, uint64 maxCycle)
     }
     deleteMatrix(A);
     deleteMatrix(K);
+    deleteMatrix(M);
+    deleteMatrix(next);
     delHashTable(hashTable);
+    if(S != NULL) {
+        deleteSparseMatrix(S);
+    }
     return lowestPower;
 }
 
-void powTest(void)
+// Check matrixPow's window and ladder paths, and matrixPowRecoded, against each
+// other and against the identity (A^m)^n == (A^n)^m.
+bool powTest(void)
 {
-    Matrix A, Am, An, key1M, key2M;
+    Matrix A, Am, An, key1M, key2M, P;
     Bignum m, n, key1V, key2V;
+    RecodedExponent recoded;
+    int lengths[] = {16, 48, 160, 400, 800};
+    Bignum e;
+    bool passed = true;
+    int bits, i, j;
 
     initRandomModule(false);
     A = allocateMatrix(randomGoodMatrix());
@@ -731,45 +2314,531 @@ void powTest(void)
     key1M = allocateMatrix(matrixPow(Am, n));
     key2M = allocateMatrix(matrixPow(An, m));
     if(!equal(key1M, key2M)) {
-        printf("Failed A^(m*n) test.\n");
+        printf("Failed A^(m*n) test for N = %d.\n", N);
+        passed = false;
+    }
+    constantTime = !constantTime;
+    if(!equal(key1M, matrixPow(Am, n))) {
+        printf("Failed constant-time pow test for N = %d.\n", N);
+        passed = false;
+    }
+    constantTime = !constantTime;
+    // A row of Am makes a full size exponent, for the widest windows.
+    deleteBignum(n);
+    n = getMatrixRow(Am, 0);
+    deleteMatrix(key1M);
+    key1M = allocateMatrix(matrixPow(A, n));
+    constantTime = !constantTime;
+    if(!equal(key1M, matrixPow(A, n))) {
+        printf("Failed full size pow test for N = %d.\n", N);
+        passed = false;
+    }
+    constantTime = !constantTime;
+    // Exponents of these lengths use each window width chooseWindowBits picks.
+    for(i = 0; i < sizeof(lengths)/sizeof(int); i++) {
+        e = createBignum(0, lengths[i]);
+        for(j = 0; j < lengths[i]; j++) {
+            setBignumBit(e, j, randomUint64() & 1);
+        }
+        setBignumBit(e, lengths[i] - 1, true);
+        P = allocateMatrix(matrixPow(A, e));
+        constantTime = !constantTime;
+        if(!equal(P, matrixPow(A, e))) {
+            printf("Failed %d bit window pow test for N = %d.\n", lengths[i], N);
+            passed = false;
+        }
+        constantTime = !constantTime;
+        deleteMatrix(P);
+        deleteBignum(e);
+    }
+    for(bits = 2; bits <= 5; bits++) {
+        recoded = recodeExponent(n, bits);
+        if(!equal(key1M, matrixPowRecoded(A, recoded))) {
+            printf("Failed %d bit recoded pow test for N = %d.\n", bits, N);
+            passed = false;
+        }
+        deleteRecodedExponent(recoded);
     }
     key1V = matrixMultiplyVector(Am, n);
     key2V = matrixMultiplyVector(Am, n);
     if(!bignumsEqual(key1V, key2V)) {
-        printf("Failed A^(m+n) test.\n");
+        printf("Failed A^(m+n) test for N = %d.\n", N);
+        passed = false;
     }
     deleteMatrix(key1M);
     deleteMatrix(key2M);
     deleteMatrix(A);
     deleteMatrix(Am);
-    deleteMatrix(Am);
+    deleteMatrix(An);
     deleteBignum(key1V);
     deleteBignum(key2V);
+    if(!passed) {
+        return false;
+    }
     printf("Passed pow test.\n");
+    return true;
+}
+
+// Check each multiply method against matrixMultiplySlow on random matrices.
+bool multiplyTest(void)
+{
+    MultiplyMethod methods[] = {MULTIPLY_ROWXOR, MULTIPLY_M4RM, MULTIPLY_STRASSEN,
+        MULTIPLY_FIXED, MULTIPLY_BLOCKED, MULTIPLY_THREADED, MULTIPLY_MASKED};
+    char *names[] = {"row XOR", "M4RM", "Strassen", "fixed width", "blocked", "threaded",
+        "masked"};
+    Matrix A, B, expected, res;
+    int crossover = strassenCrossover;
+    int savedBits = m4rmBits;
+    int numThreads = getNumThreads();
+    bool passed = true;
+    int i, j, bits;
+
+    initRandomModule(false);
+    strassenCrossover = 64; // Make Strassen recurse even on small matrices
+
+    res = allocateMatrix(NULL);
+    for(i = 0; i < 10; i++) {
+        A = allocateMatrix(randomMatrix());
+        B = allocateMatrix(randomMatrix());
+        expected = matrixMultiplySlow(A, B);
+        for(j = 0; j < sizeof(methods)/sizeof(MultiplyMethod); j++) {
+            multiplyWithMethod(res, A, B, methods[j]);
+            if(!equal(res, expected)) {
+                printf("Failed %s multiply test for N = %d.\n", names[j], N);
+                passed = false;
+            }
+        }
+        // Check the in-place and accumulate forms: (B + A*B) + B and A := A*B.
+        memcpy(res->data, B->data, N*numWords*sizeof(uint64));
+        matrixMultiplyAccumulate(res, A, B);
+        matrixMultiplyInto(A, A, B);
+        if(!equal(add(res, B), expected) || !equal(A, expected)) {
+            printf("Failed in-place multiply test for N = %d.\n", N);
+            passed = false;
+        }
+        deleteMatrix(A);
+        deleteMatrix(B);
+    }
+    // Thread chunks and Strassen base blocks choose their own table width, which
+    // must not outgrow a table sized for a narrow full-size width.  Thread chunks
+    // also hand the masked kernels row ranges that end mid-block.
+    A = allocateMatrix(randomMatrix());
+    B = allocateMatrix(randomMatrix());
+    expected = allocateMatrix(matrixMultiplySlow(A, B));
+    setNumThreads(2);
+    multiplyWithMethod(res, A, B, MULTIPLY_MASKED);
+    if(!equal(res, expected)) {
+        printf("Failed threaded masked multiply test for N = %d.\n", N);
+        passed = false;
+    }
+    matrixSquareInto(res, A);
+    if(!equal(res, matrixMultiplySlow(A, A))) {
+        printf("Failed threaded square test for N = %d.\n", N);
+        passed = false;
+    }
+    for(bits = 1; bits <= 4; bits++) {
+        setM4RMBits(bits);
+        multiplyWithMethod(res, A, B, MULTIPLY_THREADED);
+        if(!equal(res, expected)) {
+            printf("Failed threaded multiply test with %d bit tables for N = %d.\n", bits, N);
+            passed = false;
+        }
+        multiplyWithMethod(res, A, B, MULTIPLY_STRASSEN);
+        if(!equal(res, expected)) {
+            printf("Failed Strassen multiply test with %d bit tables for N = %d.\n", bits, N);
+            passed = false;
+        }
+    }
+    setNumThreads(numThreads);
+    setM4RMBits(savedBits);
+    deleteMatrix(A);
+    deleteMatrix(B);
+    deleteMatrix(expected);
+    deleteMatrix(res);
+    strassenCrossover = crossover;
+    if(passed) {
+        printf("Passed multiply test.\n");
+    }
+    return passed;
+}
+
+// Check the fixed-width vector product and elimination kernels against the
+// generic code, on random matrices.
+bool fixedKernelTest(void)
+{
+    FixedKernels *kernels = getKernels();
+    EliminationMethod method = eliminationMethod;
+    Matrix A, I1, I2;
+    SparseMatrix S;
+    Bignum v, res1, res2;
+    bool savedConstantTime = constantTime;
+    bool singular1, singular2;
+    bool passed = true;
+    int i;
+
+    if(kernels == NULL) {
+        printf("No fixed width kernels for N = %d.\n", N);
+        return true;
+    }
+    initRandomModule(false);
+    setEliminationMethod(ELIMINATE_FIXED);
+    for(i = 0; i < 10 && passed; i++) {
+        A = allocateMatrix(randomMatrix());
+        v = getMatrixRow(randomMatrix(), 0);
+        fixedKernels = kernels;
+        res1 = vectorMultiplyMatrix(v, A);
+        res2 = matrixMultiplyVector(A, v);
+        singular1 = isSingular(A);
+        I1 = singular1? NULL : allocateMatrix(inverse(A));
+        fixedKernels = NULL;
+        passed = bignumsEqual(res1, vectorMultiplyMatrix(v, A)) &&
+            bignumsEqual(res2, matrixMultiplyVector(A, v));
+        singular2 = isSingular(A);
+        if(singular1 != singular2) {
+            passed = false;
+        } else if(!singular1) {
+            I2 = inverse(A);
+            passed = passed && equal(I1, I2) && equal(matrixMultiply(A, I1), identity());
+            deleteMatrix(I1);
+        }
+        deleteMatrix(A);
+        deleteBignum(v);
+        deleteBignum(res1);
+        deleteBignum(res2);
+    }
+    // The masked vector products for constant-time mode, against the plain one.
+    for(i = 0; i < 10 && passed; i++) {
+        A = allocateMatrix(randomMatrix());
+        v = getMatrixRow(randomMatrix(), 0);
+        fixedKernels = kernels;
+        res1 = vectorMultiplyMatrix(v, A);
+        constantTime = true;
+        res2 = vectorMultiplyMatrix(v, A);
+        passed = bignumsEqual(res1, res2);
+        deleteBignum(res2);
+        fixedKernels = NULL;
+        res2 = vectorMultiplyMatrix(v, A);
+        passed = passed && bignumsEqual(res1, res2);
+        constantTime = savedConstantTime;
+        deleteBignum(res1);
+        deleteBignum(res2);
+        deleteBignum(v);
+        deleteMatrix(A);
+    }
+    // Vectors read from key files can have bits set past N, which have no rows.
+    if(passed && lastWordMask != ~(uint64)0) {
+        A = allocateMatrix(randomMatrix());
+        S = createSparseMatrix(A);
+        v = getMatrixRow(randomMatrix(), 0);
+        fixedKernels = kernels;
+        res1 = vectorMultiplyMatrix(v, A);
+        getBignumData(v)[numWords - 1] |= ~lastWordMask;
+        res2 = vectorMultiplyMatrix(v, A);
+        passed = bignumsEqual(res1, res2);
+        deleteBignum(res2);
+        fixedKernels = NULL;
+        res2 = vectorMultiplyMatrix(v, A);
+        passed = passed && bignumsEqual(res1, res2);
+        deleteBignum(res2);
+        res2 = vectorMultiplySparse(v, S);
+        passed = passed && bignumsEqual(res1, res2);
+        deleteBignum(res2);
+        deleteBignum(res1);
+        deleteBignum(v);
+        deleteSparseMatrix(S);
+        deleteMatrix(A);
+    }
+    fixedKernels = kernels;
+    setEliminationMethod(method);
+    if(!passed) {
+        printf("Failed fixed width kernel test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed fixed width kernel test.\n");
+    return true;
+}
+
+// Check blocked elimination against Gauss-Jordan on random matrices, some with
+// repeated rows, so the rank and the pivot search for missing pivots are tested.
+bool eliminationTest(void)
+{
+    EliminationMethod method = eliminationMethod;
+    Matrix A, I1, I2;
+    int rank1, rank2;
+    bool singular1, singular2;
+    bool passed = true;
+    int i, row;
+
+    initRandomModule(false);
+    for(i = 0; i < 20 && passed; i++) {
+        A = allocateMatrix(randomMatrix());
+        for(row = 0; row < i/2 && row < N; row++) {
+            memcpy(A->data + randomUint64() % N*numWords, A->data + row*numWords,
+                numWords*sizeof(uint64));
+        }
+        setEliminationMethod(ELIMINATE_GAUSS_JORDAN);
+        rank1 = getMatrixRank(A);
+        singular1 = isSingular(A);
+        I1 = singular1? NULL : allocateMatrix(inverse(A));
+        setEliminationMethod(ELIMINATE_M4RI);
+        rank2 = getMatrixRank(A);
+        singular2 = isSingular(A);
+        passed = rank1 == rank2 && singular1 == singular2 && singular1 == (rank1 < N);
+        if(passed && !singular1) {
+            I2 = inverse(A);
+            passed = equal(I1, I2) && equal(matrixMultiply(A, I2), identity());
+        }
+        if(I1 != NULL) {
+            deleteMatrix(I1);
+        }
+        deleteMatrix(A);
+    }
+    setEliminationMethod(method);
+    if(!passed) {
+        printf("Failed elimination test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed elimination test.\n");
+    return true;
+}
+
+// Check the block transpose and transposed views against transposing one bit at
+// a time, on random matrices.
+bool transposeTest(void)
+{
+    Matrix A, T;
+    Bignum v, res;
+    bool passed = true;
+    int i, row, col;
+
+    initRandomModule(false);
+    for(i = 0; i < 10 && passed; i++) {
+        A = allocateMatrix(randomMatrix());
+        v = getMatrixRow(randomMatrix(), 0);
+        res = matrixMultiplyVector(A, v); // Before A has a view
+        T = getTransposed(A);
+        for(row = 0; row < N; row++) {
+            for(col = 0; col < N; col++) {
+                passed = passed && getBit(T, row, col) == getBit(A, col, row);
+            }
+        }
+        passed = passed && getTransposed(A) == T && equal(getTransposed(T), A) &&
+            bignumsEqual(res, matrixMultiplyVector(A, v));
+        deleteMatrix(A);
+        deleteBignum(v);
+        deleteBignum(res);
+    }
+    if(!passed) {
+        printf("Failed transpose test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed transpose test.\n");
+    return true;
+}
+
+// Return p(A), by Horner's rule.
+static Matrix evaluatePolynomial(Bignum p, Matrix A)
+{
+    Matrix res = allocateMatrix(zero());
+    Matrix next = allocateMatrix(NULL);
+    int i, row;
+
+    for(i = polyDegree(p); i >= 0; i--) {
+        matrixMultiplyInto(next, res, A);
+        swapMatrices(&res, &next);
+        if(getBignumBit(p, i)) {
+            for(row = 0; row < N; row++) {
+                setBit(res, row, row, !getBit(res, row, row));
+            }
+        }
+    }
+    A = copy(res);
+    deleteMatrix(res);
+    deleteMatrix(next);
+    return A;
+}
+
+// Return the polynomial with the given low 64 coefficients.
+static Bignum smallPolynomial(uint64 coefficients)
+{
+    return createBignum(coefficients, 64);
+}
+
+// Check characteristic and minimal polynomials with Cayley-Hamilton on random
+// matrices, and the irreducibility test on a few known polynomials and on the
+// acceptance of good matrices.
+bool polynomialTest(void)
+{
+    Matrix A;
+    Bignum f, m, r;
+    bool passed = true;
+    int i;
+
+    // x^2 + x + 1 and x^4 + x + 1 are irreducible.  x^2 + 1 = (x + 1)^2,
+    // x^4 + x^2 + 1 = (x^2 + x + 1)^2, and x^5 + x^4 + 1 = (x^2 + x + 1)(x^3 + x + 1)
+    // are not.
+    passed = isIrreducible(smallPolynomial(0x7)) && isIrreducible(smallPolynomial(0x13)) &&
+        !isIrreducible(smallPolynomial(0x5)) && !isIrreducible(smallPolynomial(0x15)) &&
+        !isIrreducible(smallPolynomial(0x31));
+    initRandomModule(false);
+    for(i = 0; i < 5 && passed; i++) {
+        A = allocateMatrix(i == 0? randomGoodMatrix() : randomMatrix());
+        f = characteristicPolynomial(A);
+        m = minimalPolynomial(A);
+        r = polyRemainder(f, m);
+        passed = polyDegree(f) == N && polyDegree(r) == -1 &&
+            equal(evaluatePolynomial(f, A), zero()) && equal(evaluatePolynomial(m, A), zero());
+        if(i == 0) {
+            passed = passed && isIrreducible(f) && bignumsEqual(f, m) && hasGoodPowerOrder(A);
+        } else if(isIrreducible(f)) {
+            passed = passed && hasGoodPowerOrder(A);
+        }
+        deleteBignum(f);
+        deleteBignum(m);
+        deleteBignum(r);
+        deleteMatrix(A);
+    }
+    if(!passed) {
+        printf("Failed polynomial test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed polynomial test.\n");
+    return true;
+}
+
+// Check the sparse kernels against dense products, on random low weight matrices.
+bool sparseTest(void)
+{
+    Matrix A, B, C;
+    SparseMatrix S;
+    Bignum v, res;
+    bool passed = true;
+    int i;
+
+    initRandomModule(false);
+    for(i = 0; i < 10 && passed; i++) {
+        A = allocateMatrix(randomSparseMatrix(1 + i % 4));
+        B = allocateMatrix(randomMatrix());
+        v = getMatrixRow(randomMatrix(), 0);
+        S = createSparseMatrix(A);
+        passed = getSparseMatrixWeight(S) == getMatrixWeight(A) &&
+            equal(sparseMultiply(S, B), matrixMultiply(A, B));
+        res = vectorMultiplySparse(v, S);
+        passed = passed && bignumsEqual(res, vectorMultiplyMatrix(v, A));
+        C = matrixMultiply(A, B);
+        sparseMultiplyInto(B, S, B);
+        passed = passed && equal(B, C);
+        deleteMatrix(A);
+        deleteMatrix(B);
+        deleteBignum(v);
+        deleteBignum(res);
+        deleteSparseMatrix(S);
+    }
+    if(!passed) {
+        printf("Failed sparse test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed sparse test.\n");
+    return true;
+}
+
+// Convert between Matrix and SmallMatrix.  Both have one word per row for N <= 64.
+static void toSmallMatrix(SmallMatrix *res, Matrix M)
+{
+    int row;
+
+    if(N > 8) {
+        memcpy(res->rows, M->data, N*sizeof(uint64));
+        return;
+    }
+    res->rows[0] = 0;
+    for(row = 0; row < N; row++) {
+        res->rows[0] |= M->data[row] << 8*row;
+    }
+}
+
+static Matrix fromSmallMatrix(SmallMatrix *M)
+{
+    Matrix res = zero();
+    int row;
+
+    for(row = 0; row < N; row++) {
+        res->data[row] = N > 8? M->rows[row] : (M->rows[0] >> 8*row) & 0xff;
+    }
+    return res;
+}
+
+// Check the small matrix engine against the general one on random matrices.
+bool smallMatrixTest(void)
+{
+    SmallMatrix A, B, C;
+    Matrix MA, MB;
+    Bignum n;
+    bool passed = true;
+    int i;
+
+    if(N > 64) {
+        return true;
+    }
+    initRandomModule(false);
+    setSmallMatrixSize(N);
+    for(i = 0; i < 20 && passed; i++) {
+        MA = allocateMatrix(randomMatrix());
+        MB = allocateMatrix(randomMatrix());
+        n = createBignum(randomUint64(), 64);
+        toSmallMatrix(&A, MA);
+        toSmallMatrix(&B, MB);
+        smallMultiply(&C, &A, &B);
+        passed = equal(fromSmallMatrix(&C), matrixMultiply(MA, MB));
+        smallPow(&C, &A, getBignumWord(n, 0));
+        passed = passed && equal(fromSmallMatrix(&C), matrixPow(MA, n));
+        passed = passed && smallIsSingular(&A) == isSingular(MA);
+        if(!isSingular(MA)) {
+            passed = passed && smallHasGoodPowerOrder(&A) == hasGoodPowerOrder(MA);
+        }
+        deleteMatrix(MA);
+        deleteMatrix(MB);
+        deleteBignum(n);
+    }
+    if(!passed) {
+        printf("Failed small matrix test for N = %d.\n", N);
+        return false;
+    }
+    printf("Passed small matrix test.\n");
+    return true;
 }
 
 static uint64 simpleFindCycleLength(Matrix A, long long maxCycle)
 {
     Matrix origA = allocateMatrix(A);
+    SparseMatrix S = sparseFormOf(origA);
     uint64 i;
 
     for(i = 1; i < maxCycle; i++) {
-        A = matrixMultiply(A, origA);
+        // A is a power of origA, so A*origA == origA*A.
+        A = S != NULL? sparseMultiply(S, A) : matrixMultiply(A, origA);
         if(isSingular(A)) {
             printf("Singular matrix found!\n");
         }
         if(equal(A, origA)) {
             //printf("Cycle length is %d\n", i);
-            deleteMatrix(origA);
-            return i;
+            break;
         }
     }
     deleteMatrix(origA);
-    printf("Cycle length is > %lld\n", maxCycle);
-    return -1;
+    if(S != NULL) {
+        deleteSparseMatrix(S);
+    }
+    if(i == maxCycle) {
+        printf("Cycle length is > %lld\n", maxCycle);
+        return -1;
+    }
+    return i;
 }
 
 // max order matrix, then test passes for N.
+// Matrices of up to 64 bits are checked with the small matrix engine, which
+// finds orders by factoring 2^N - 1 rather than searching for a cycle.
 bool checkPrimeOrderTheory(void)
 {
     Matrix A;
@@ -777,8 +2846,12 @@ bool checkPrimeOrderTheory(void)
     int passes = 0;
     int i;
 
+    if(N <= 64) {
+        setSmallMatrixSize(N);
+        return smallCheckPrimeOrderTheory();
+    }
     for(i = 0; i < 1000; i++) {
-        A = randomNonSingularMatrix();
+        A = randomNonSingularMatrix(0);
         A = allocateMatrix(A);
         if(hasGoodPowerOrder(A)) {
             order = findCycleLength(A, 1LL << (N + 1));
@@ -810,11 +2883,327 @@ static void initQueue(void)
 
 void initMatrixModule(int width)
 {
+    TuningProfile profile;
+
     // TODO: if this is called twice, free matrix memory
     firstFreeMatrix = NULL;
     setMatrixWidth(width);
+    initSimdModule();
+    fixedKernelsLevel = getSimdLevel();
+    fixedKernels = getFixedKernels(numWords, fixedKernelsLevel);
     initParityTable();
     initQueue();
+    scratchMatrix = allocateMatrix(NULL);
+    free(m4rmTable);
+    m4rmTable = (uint64 *)malloc((1 << m4rmBits)*numWords*sizeof(uint64));
+    if(l1CacheSize == 0) {
+        l1CacheSize = detectCacheSize(1);
+        l2CacheSize = detectCacheSize(2);
+    }
+    chooseTileSizes();
+    if(readProfile(N, &profile)) {
+        applyProfile(&profile);
+    }
+}
+
+// Return the matrix whose row i is v*G^i, built with vector products only.
+Matrix krylovMatrix(Matrix G, Bignum v)
+{
+    Matrix K = zero();
+    SparseMatrix S = sparseFormOf(G);
+    Bignum row = getMatrixRow(K, 0);
+    Bignum next;
+    int i;
+
+    memcpy(getBignumData(row), getBignumData(v), numWords*sizeof(uint64));
+    for(i = 0; i < N; i++) {
+        setRow(K, i, row);
+        if(i + 1 < N) {
+            next = S != NULL? vectorMultiplySparse(row, S) : vectorMultiplyMatrix(row, G);
+            deleteBignum(row);
+            row = next;
+        }
+    }
+    deleteBignum(row);
+    if(S != NULL) {
+        deleteSparseMatrix(S);
+    }
+    return K;
+}
+
+// A basis in echelon form of a subspace spanned by Krylov sequences, kept as we
+// extend the subspace one vector at a time.  Each row has a tag, the
+// polynomial p in A with p(A) applied to the current sequence's start giving
+// the row, modulo the span of earlier sequences.
+typedef struct {
+    uint64 *rows, *tags;
+    int *pivots;
+    int size, tagWords;
+} KrylovBasis;
+
+static void initKrylovBasis(KrylovBasis *B)
+{
+    B->tagWords = (N + 64) >> 6; // Tags have degree up to N
+    B->rows = (uint64 *)calloc((size_t)N*numWords, sizeof(uint64));
+    B->tags = (uint64 *)calloc((size_t)N*B->tagWords, sizeof(uint64));
+    B->pivots = (int *)calloc(N, sizeof(int));
+    B->size = 0;
+}
+
+static void freeKrylovBasis(KrylovBasis *B)
+{
+    free(B->rows);
+    free(B->tags);
+    free(B->pivots);
+}
+
+// Return the polynomial p of least degree for which u*p(A) lies in the span of
+// B, and add the sequence u, u*A, ... u*A^(deg p - 1) to B.  The span of B must
+// be invariant under A, as a sum of Krylov subspaces is.  The degree of p is
+// how much the span grew, and p is the characteristic polynomial of A on the
+// quotient space.  S is the sparse form of A, or NULL.
+static Bignum extendKrylovBasis(KrylovBasis *B, Matrix A, SparseMatrix S, Bignum u)
+{
+    Bignum v = createBignum(0, N);
+    Bignum next, p;
+    uint64 *data, *tag;
+    int i, pivot;
+
+    // Earlier sequences are only needed modulo their span, so their tags go.
+    memset(B->tags, 0, (size_t)B->size*B->tagWords*sizeof(uint64));
+    tag = (uint64 *)calloc(B->tagWords, sizeof(uint64));
+    tag[0] = 1;
+    memcpy(getBignumData(v), getBignumData(u), numWords*sizeof(uint64));
+    while(true) {
+        data = getBignumData(v);
+        for(i = 0; i < B->size; i++) {
+            pivot = B->pivots[i];
+            if((data[pivot >> 6] >> (pivot & 0x3f)) & 1) {
+                xorRowWords(data, B->rows + i*numWords, numWords);
+                xorRowWords(tag, B->tags + i*B->tagWords, B->tagWords);
+            }
+        }
+        for(i = 0; i < numWords && data[i] == 0; i++);
+        if(i == numWords) {
+            break;
+        }
+        pivot = (i << 6) + __builtin_ctzll(data[i]);
+        memcpy(B->rows + B->size*numWords, data, numWords*sizeof(uint64));
+        memcpy(B->tags + B->size*B->tagWords, tag, B->tagWords*sizeof(uint64));
+        B->pivots[B->size++] = pivot;
+        // The reduced vector times A has the tag times x.
+        next = S != NULL? vectorMultiplySparse(v, S) : vectorMultiplyMatrix(v, A);
+        deleteBignum(v);
+        v = next;
+        for(i = B->tagWords - 1; i > 0; i--) {
+            tag[i] = (tag[i] << 1) | (tag[i - 1] >> 63);
+        }
+        tag[0] <<= 1;
+    }
+    p = createBignum(0, N + 1);
+    memcpy(getBignumData(p), tag, B->tagWords*sizeof(uint64));
+    free(tag);
+    deleteBignum(v);
+    return p;
+}
+
+// Return the minimal polynomial of v under A: the monic p of least degree with
+// v*p(A) == 0.  This is one Krylov sequence, so it stops as soon as v*A^k depends
+// on the earlier vectors, which for most matrices that are not generators is
+// well before N.
+Bignum vectorMinimalPolynomial(Matrix A, Bignum v)
+{
+    KrylovBasis B;
+    SparseMatrix S = sparseFormOf(A);
+    Bignum p;
+
+    initKrylovBasis(&B);
+    p = extendKrylovBasis(&B, A, S, v);
+    freeKrylovBasis(&B);
+    if(S != NULL) {
+        deleteSparseMatrix(S);
+    }
+    return p;
+}
+
+// Return a copy of polynomial a, resized to N + 1 bits, and delete a.  Its
+// degree must be at most N.
+static Bignum toDegreeN(Bignum a)
+{
+    Bignum res = createBignum(0, N + 1);
+    int words = (N + 64) >> 6;
+    int aWords = (getBignumSize(a) + 63) >> 6;
+
+    memcpy(getBignumData(res), getBignumData(a), (aWords < words? aWords : words)*sizeof(uint64));
+    deleteBignum(a);
+    return res;
+}
+
+// Find the characteristic polynomial of A, and if minimal is not NULL, set it to
+// the minimal polynomial.  Krylov sequences of unit vectors not yet spanned are
+// added until they span everything.  The characteristic polynomial is the
+// product of A's characteristic polynomials on the successive quotients, and
+// the minimal polynomial is the least common multiple of the minimal
+// polynomials of the vectors that start the sequences, since their Krylov
+// subspaces sum to the whole space.
+static Bignum krylovPolynomials(Matrix A, Bignum *minimal)
+{
+    KrylovBasis B;
+    SparseMatrix S = sparseFormOf(A);
+    Bignum f = createBignum(1, N + 1);
+    Bignum u = createBignum(0, N);
+    Bignum p, m, g, q, product;
+    int j;
+
+    initKrylovBasis(&B);
+    if(minimal != NULL) {
+        *minimal = createBignum(1, N + 1);
+    }
+    for(j = 0; j < N && B.size < N; j++) {
+        setBignumBit(u, j, true);
+        p = extendKrylovBasis(&B, A, S, u);
+        if(polyDegree(p) > 0) {
+            product = polyMultiply(f, p);
+            deleteBignum(f);
+            f = toDegreeN(product);
+            if(minimal != NULL) {
+                m = vectorMinimalPolynomial(A, u);
+                g = polyGcd(*minimal, m);
+                q = polyDivide(m, g);
+                product = polyMultiply(*minimal, q);
+                deleteBignum(*minimal);
+                *minimal = toDegreeN(product);
+                deleteBignum(m);
+                deleteBignum(g);
+                deleteBignum(q);
+            }
+        }
+        setBignumBit(u, j, false);
+        deleteBignum(p);
+    }
+    deleteBignum(u);
+    freeKrylovBasis(&B);
+    if(S != NULL) {
+        deleteSparseMatrix(S);
+    }
+    return f;
+}
+
+// Return the characteristic polynomial of A, as an N + 1 bit Bignum.
+Bignum characteristicPolynomial(Matrix A)
+{
+    return krylovPolynomials(A, NULL);
+}
+
+// Return the minimal polynomial of A, as an N + 1 bit Bignum.
+Bignum minimalPolynomial(Matrix A)
+{
+    Bignum m;
+
+    deleteBignum(krylovPolynomials(A, &m));
+    return m;
+}
+
+// Make CInverse the reconstruction basis of G.  Matrices from before
+// initMatrixModule changed N can not go on the new free list, so an old basis
+// of another size is just dropped.
+static void setReconstructionBasis(Matrix G, Matrix CInverse)
+{
+    if(basisGenerator != NULL && basisSize == N) {
+        deleteMatrix(basisGenerator);
+        if(basisInverse != NULL) {
+            deleteMatrix(basisInverse);
+        }
+    }
+    basisGenerator = allocateMatrix(G);
+    basisInverse = CInverse != NULL? allocateMatrix(CInverse) : NULL;
+    basisSize = N;
+}
+
+// Return the reconstruction basis of G: the inverse of C, whose row i is the
+// first row of G^i.  C depends only on G, so it is inverted once and kept for
+// later calls with the same generator.  Returns NULL if C is singular.
+Matrix getReconstructionBasis(Matrix G)
+{
+    Matrix C;
+    Bignum e0;
+
+    if(basisGenerator != NULL && basisSize == N && equal(basisGenerator, G)) {
+        return basisInverse;
+    }
+    e0 = createBignum(1, N);
+    C = krylovMatrix(G, e0);
+    deleteBignum(e0);
+    setReconstructionBasis(G, inverse(C));
+    return basisInverse;
+}
+
+// Return the squaring map of G, given CInverse, its reconstruction basis: for
+// any H that is a polynomial in G, the first row of H^2 is the first row of H
+// times this matrix.  In characteristic 2, (sum c_i G^i)^2 = sum c_i G^(2i), so
+// squaring is linear, and takes row i of C to e0*G^(2i), row i of the Krylov
+// matrix of G^2.
+Matrix squaringMap(Matrix G, Matrix CInverse)
+{
+    Matrix G2 = allocateMatrix(matrixMultiply(G, G));
+    Bignum e0 = createBignum(1, N);
+    Matrix Q = matrixMultiply(CInverse, krylovMatrix(G2, e0));
+
+    deleteBignum(e0);
+    deleteMatrix(G2);
+    return Q;
+}
+
+// Write the reconstruction basis of G to a file, so other processes can load
+// it rather than invert C.  The header has N and a hash of G, so a basis is
+// never loaded for the wrong generator.
+bool writeReconstructionBasis(char *fileName, Matrix G)
+{
+    Matrix CInverse = getReconstructionBasis(G);
+    FILE *file;
+
+    if(CInverse == NULL) {
+        printf("Generator has no reconstruction basis\n");
+        return false;
+    }
+    file = fopen(fileName, "wb");
+    if(file == NULL) {
+        printf("Unable to write to file %s.\n", fileName);
+        return false;
+    }
+    fprintf(file, "bmat basis %d %d %u\n", BASIS_VERSION, N, hashMatrix(G));
+    if(fwrite(CInverse->data, sizeof(uint64), N*numWords, file) != N*numWords) {
+        printf("Unable to write basis to %s\n", fileName);
+        fclose(file);
+        return false;
+    }
+    return fclose(file) == 0;
+}
+
+// Load the reconstruction basis of G from a file written by
+// writeReconstructionBasis.  Return false if there is no such file, or it is
+// for another generator.
+bool readReconstructionBasis(char *fileName, Matrix G)
+{
+    FILE *file = fopen(fileName, "rb");
+    Matrix CInverse;
+    unsigned hash;
+    int version, size;
+    bool passed;
+
+    if(file == NULL) {
+        return false;
+    }
+    CInverse = zero();
+    passed = fscanf(file, "bmat basis %d %d %u", &version, &size, &hash) == 3 &&
+        version == BASIS_VERSION && size == N && hash == hashMatrix(G) &&
+        fgetc(file) == '\n' &&
+        fread(CInverse->data, sizeof(uint64), N*numWords, file) == N*numWords;
+    fclose(file);
+    if(passed) {
+        setReconstructionBasis(G, CInverse);
+    }
+    return passed;
 }
 
 // Reconstruct the user's matrix from his published first row.  We use the
@@ -830,26 +3219,82 @@ void initMatrixModule(int width)
 //     enter constraints v == m*H as rows in V and C
 // V = C*H
 // H = C-1*V
+// Row k of V is h*G^k, which is just row k-1 times G, so V is built with
+// vector products and G^k is never formed.  C is the same for every public
+// key, so its inverse comes from the cached reconstruction basis.
 Matrix reconstructMatrix(Matrix G, Bignum h)
 {
-    Matrix V = allocateMatrix(zero()); // We will store various values of g here
-    Matrix C = allocateMatrix(zero()); // We will store various values of gH (computed as hG) here
-    Matrix M = copy(G);
-    Bignum m, v;
-    int i = 1;
-
-    // First constraint is just h=O*H
-    setRow(C, 0, createBignum(1, N));
-    setRow(V, 0, h);
-    while(i < N) {
-        m = getMatrixRow(M, 0);
-        v = vectorMultiplyMatrix(h, M);
-        //if(linearlyIndependent(H, i, v)) {
-            setRow(V, i, v);
-            setRow(C, i, m);
-            i++;
-            M = matrixMultiply(M, G);
-        //}
+    Matrix CInverse = getReconstructionBasis(G);
+
+    if(CInverse == NULL) {
+        printf("Rows of the generator's powers are dependent, so H can not be found\n");
+        return NULL;
+    }
+    return matrixMultiply(CInverse, krylovMatrix(G, h));
+}
+
+// Reconstruct the matrices for numKeys public keys of the same generator, into
+// results, which the caller must delete.  Up to N keys at a time are stacked as
+// the rows of P, and one multiply P = P*G advances all of them a step through
+// G.  After k steps, row j of P is row k of V for key j, so P is copied into row
+// k of W, which holds the V matrices side by side.  Then one product CInverse*W
+// gives all the H matrices side by side, sharing CInverse's table lookups.  The
+// product runs over bands of keys whose tables fill an eighth of L2, so the
+// tables and the band of W and H being used stay in L2.
+void reconstructMatrices(Matrix G, Bignum *keys, Matrix *results, int numKeys)
+{
+    Matrix CInverse = getReconstructionBasis(G);
+    Matrix P = allocateMatrix(NULL);
+    Matrix next = allocateMatrix(NULL);
+    int maxWords = (numKeys < N? numKeys : N)*numWords;
+    uint64 *W = (uint64 *)malloc((size_t)N*maxWords*sizeof(uint64));
+    uint64 *H = (uint64 *)malloc((size_t)N*maxWords*sizeof(uint64));
+    int bandWords = (l2CacheSize/8)/((1 << m4rmBits)*numWords*sizeof(uint64))*numWords;
+    uint64 *table;
+    int first, count, words, band, width, j, k;
+
+    if(bandWords < numWords) {
+        bandWords = numWords;
+    }
+    table = (uint64 *)malloc(((size_t)1 << m4rmBits)*bandWords*sizeof(uint64));
+
+    for(first = 0; first < numKeys; first += N) {
+        count = numKeys - first < N? numKeys - first : N;
+        words = count*numWords;
+        if(CInverse == NULL) {
+            printf("Rows of the generator's powers are dependent, so H can not be found\n");
+            for(j = 0; j < count; j++) {
+                results[first + j] = NULL;
+            }
+            continue;
+        }
+        memset(P->data, 0, N*numWords*sizeof(uint64));
+        for(j = 0; j < count; j++) {
+            setRow(P, j, keys[first + j]);
+        }
+        for(k = 0; k < N; k++) {
+            memcpy(W + (size_t)k*words, P->data, words*sizeof(uint64));
+            if(k + 1 < N) {
+                matrixMultiplyInto(next, P, G);
+                swapMatrices(&P, &next);
+            }
+        }
+        for(band = 0; band < words; band += bandWords) {
+            width = words - band < bandWords? words - band : bandWords;
+            m4rmMultiplyData(H + band, words, CInverse->data, numWords, W + band, words, N, N,
+                width, table, m4rmBits, false);
+        }
+        for(j = 0; j < count; j++) {
+            results[first + j] = allocateMatrix(NULL);
+            for(k = 0; k < N; k++) {
+                memcpy(results[first + j]->data + k*numWords, H + (size_t)k*words + j*numWords,
+                    numWords*sizeof(uint64));
+            }
+        }
     }
-    return matrixMultiply(inverse(C), V);
+    free(W);
+    free(H);
+    free(table);
+    deleteMatrix(P);
+    deleteMatrix(next);
 }
@@ -0,0 +1,1086 @@
+// Polynomial arithmetic over GF(2), for computing powers of a generator in its
+// own algebra.  Every power of G is a polynomial in G, and if the first row e0
+// of the identity has N independent images e0, e0*G, ... , e0*G^(N-1), a matrix
+// p(G) is determined by its first row, which is p*K, where row i of K is
+// e0*G^i.  So rather than multiplying N x N matrices, we multiply N bit
+// polynomials modulo f, the characteristic polynomial of G, and only convert
+// to and from first rows at the edges.  A multiply is then about (N/64)^2
+// carry-less word multiplies plus a Barrett reduction, instead of an O(N^3)
+// matrix product.
+
+#define _DEFAULT_SOURCE // For mmap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bmat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
+// A field is the polynomials of degree < N, with arithmetic modulo f.  f has
+// degree N, and we keep only its low N bits; the x^N term is implied.
+struct FieldStruct {
+    int N, numWords;
+    uint64 topMask; // The valid bits of the last word of an element
+    uint64 *modulus; // Low N bits of f
+    uint64 *mu; // Low N bits of x^2N/f, for Barrett reduction.  Its x^N term is implied.
+    Matrix G, K, KInverse; // Row i of K is the first row of G^i
+    // The squaring map on first rows, and its power for repeated squarings
+    Matrix squaring, squaringPower;
+    int squaringExponent;
+    uint64 *product, *quotient, *temp; // Work space, 2*numWords words each
+    // Fixed-base comb table: entry d of window j is x^(d*2^(j*combBits)).
+    uint64 *combTable;
+    int combBits, combWindows;
+    void *combMap; // The mapped file, if the table was loaded rather than built
+    size_t combMapSize;
+};
+
+// A comb table file is a header of COMB_HEADER_WORDS words, then the low N bits
+// of f, then the table.  f ties the table to one generator's field.
+#define COMB_MAGIC 0x626d6174636f6d62ULL // "bmatcomb"
+#define COMB_VERSION 1
+#define COMB_HEADER_WORDS 4
+#define MAX_COMB_BITS 12
+// randomIrreduciblePolynomial sieves out candidates with factors up to this degree.
+#define SIEVE_DEGREE 12
+
+static bool useClmul = true;
+
+static void freeCombTable(Field F);
+static void remainderWords(uint64 *a, int aWords, uint64 *b, int bDegree, uint64 *quotient);
+
+// The field of the last generator passed to matrixPowRow.  cachedGenerator is
+// kept even when G has no field, so we do not retry building it.
+static Field cachedField;
+static Matrix cachedGenerator;
+static int cachedSize;
+
+// Multiply two numWords word polynomials into 2*numWords words of res.
+static void (*clmulWords)(uint64 *res, uint64 *a, uint64 *b, int numWords);
+static void (*clmulSquare)(uint64 *res, uint64 *a, int numWords);
+
+// Carry-less multiply of two words, a bit at a time.  The masks rather than
+// branches keep the time independent of the data.
+static inline void clmulWordScalar(uint64 a, uint64 b, uint64 *low, uint64 *high)
+{
+    uint64 lowSum = 0, highSum = 0, mask;
+    int i;
+
+    for(i = 0; i < 64; i++) {
+        mask = -((a >> i) & 1);
+        lowSum ^= (b << i) & mask;
+        highSum ^= (i == 0? 0 : b >> (64 - i)) & mask;
+    }
+    *low = lowSum;
+    *high = highSum;
+}
+
+static void clmulWordsScalar(uint64 *res, uint64 *a, uint64 *b, int numWords)
+{
+    uint64 low, high;
+    int i, j;
+
+    memset(res, 0, 2*numWords*sizeof(uint64));
+    for(i = 0; i < numWords; i++) {
+        for(j = 0; j < numWords; j++) {
+            clmulWordScalar(a[i], b[j], &low, &high);
+            res[i + j] ^= low;
+            res[i + j + 1] ^= high;
+        }
+    }
+}
+
+// Squaring is linear over GF(2): the cross terms cancel, so each word just
+// has its bits spread out.
+static void clmulSquareScalar(uint64 *res, uint64 *a, int numWords)
+{
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        clmulWordScalar(a[i], a[i], res + 2*i, res + 2*i + 1);
+    }
+}
+
+#ifdef X86_SIMD
+
+__attribute__((target("pclmul,sse2")))
+static void clmulWordsPCLMUL(uint64 *res, uint64 *a, uint64 *b, int numWords)
+{
+    __m128i x, product, sum;
+    int i, j;
+
+    memset(res, 0, 2*numWords*sizeof(uint64));
+    for(i = 0; i < numWords; i++) {
+        x = _mm_cvtsi64_si128(a[i]);
+        for(j = 0; j < numWords; j++) {
+            product = _mm_clmulepi64_si128(x, _mm_cvtsi64_si128(b[j]), 0x00);
+            sum = _mm_loadu_si128((__m128i *)(res + i + j));
+            _mm_storeu_si128((__m128i *)(res + i + j), _mm_xor_si128(sum, product));
+        }
+    }
+}
+
+__attribute__((target("pclmul,sse2")))
+static void clmulSquarePCLMUL(uint64 *res, uint64 *a, int numWords)
+{
+    __m128i x;
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        x = _mm_cvtsi64_si128(a[i]);
+        _mm_storeu_si128((__m128i *)(res + 2*i), _mm_clmulepi64_si128(x, x, 0x00));
+    }
+}
+
+#endif
+
+// Return true if the CPU has the PCLMULQDQ instruction.
+bool clmulSupported(void)
+{
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+#else
+    return false;
+#endif
+}
+
+static void selectClmul(void)
+{
+    clmulWords = clmulWordsScalar;
+    clmulSquare = clmulSquareScalar;
+#ifdef X86_SIMD
+    if(useClmul && clmulSupported()) {
+        clmulWords = clmulWordsPCLMUL;
+        clmulSquare = clmulSquarePCLMUL;
+    }
+#endif
+}
+
+// Allow or forbid PCLMULQDQ.  Forbidding it forces the scalar multiply.
+void setUseClmul(bool value)
+{
+    useClmul = value;
+    selectClmul();
+}
+
+// Return true if polynomial multiplies are using PCLMULQDQ.
+bool getUseClmul(void)
+{
+    return clmulWords != clmulWordsScalar;
+}
+
+// Set dest to bits shift .. shift + 64*numWords - 1 of the srcWords word source.
+static void shiftRight(uint64 *dest, uint64 *src, int srcWords, int shift, int numWords)
+{
+    int wordShift = shift >> 6;
+    int bitShift = shift & 0x3f;
+    int i, pos;
+
+    for(i = 0; i < numWords; i++) {
+        pos = i + wordShift;
+        dest[i] = pos < srcWords? src[pos] >> bitShift : 0;
+        if(bitShift != 0 && pos + 1 < srcWords) {
+            dest[i] |= src[pos + 1] << (64 - bitShift);
+        }
+    }
+}
+
+// Reduce the 2*numWords word product modulo f, into res.  With mu = x^2N/f,
+// Barrett's quotient q = ((P/x^N)*mu)/x^N is exactly P/f for polynomials over
+// GF(2), so no correction step is needed.  Both products use only low halves:
+// mu*T = T*x^N + T*(mu mod x^N), and P - q*f is known to fit in N bits.
+static void reduce(Field F, uint64 *res, uint64 *P)
+{
+    int n = F->numWords;
+    int i;
+
+    shiftRight(F->temp, P, 2*n, F->N, n);
+    clmulWords(F->quotient, F->temp, F->mu, n);
+    shiftRight(F->quotient, F->quotient, 2*n, F->N, n);
+    for(i = 0; i < n; i++) {
+        F->quotient[i] ^= F->temp[i];
+    }
+    clmulWords(F->temp, F->quotient, F->modulus, n);
+    for(i = 0; i < n; i++) {
+        res[i] = P[i] ^ F->temp[i];
+    }
+    res[n - 1] &= F->topMask;
+}
+
+// Set res to a*b mod f.  res may be a or b.
+static void multiplyMod(Field F, uint64 *res, uint64 *a, uint64 *b)
+{
+    clmulWords(F->product, a, b, F->numWords);
+    reduce(F, res, F->product);
+}
+
+static void squareMod(Field F, uint64 *res, uint64 *a)
+{
+    clmulSquare(F->product, a, F->numWords);
+    reduce(F, res, F->product);
+}
+
+// Find x^2N/f by long division.  This is only done once per field.
+static void computeMu(Field F)
+{
+    int N = F->N;
+    int remWords = (2*N + 64) >> 6;
+    uint64 *remainder = (uint64 *)calloc(remWords, sizeof(uint64));
+    uint64 *quotient = (uint64 *)calloc(remWords, sizeof(uint64));
+    uint64 *f = (uint64 *)calloc(F->numWords + 1, sizeof(uint64));
+
+    remainder[(2*N) >> 6] = (uint64)1 << ((2*N) & 0x3f);
+    memcpy(f, F->modulus, F->numWords*sizeof(uint64));
+    f[N >> 6] |= (uint64)1 << (N & 0x3f);
+    remainderWords(remainder, remWords, f, N, quotient);
+    memcpy(F->mu, quotient, F->numWords*sizeof(uint64));
+    F->mu[F->numWords - 1] &= F->topMask;
+    free(remainder);
+    free(quotient);
+    free(f);
+}
+
+// Allocate a field of N bit elements, with room for its modulus and work space.
+static Field allocateField(int N)
+{
+    int numWords = (N + 63) >> 6;
+    Field F = (Field)calloc(1, sizeof(struct FieldStruct));
+
+    selectClmul();
+    F->N = N;
+    F->numWords = numWords;
+    F->topMask = (N & 0x3f) == 0? ~(uint64)0 : ((uint64)1 << (N & 0x3f)) - 1;
+    F->modulus = (uint64 *)calloc(numWords, sizeof(uint64));
+    F->mu = (uint64 *)calloc(numWords, sizeof(uint64));
+    F->product = (uint64 *)calloc(2*numWords, sizeof(uint64));
+    F->quotient = (uint64 *)calloc(2*numWords, sizeof(uint64));
+    F->temp = (uint64 *)calloc(2*numWords, sizeof(uint64));
+    return F;
+}
+
+// Build the field for generator G, which must be the current matrix size.
+// Returns NULL if e0 does not have N independent images under G, in which case
+// matrices are not determined by their first rows.  K's inverse is the reconstruction basis, so it is shared with
+// reconstructMatrix, and loaded from a basis file if there is one.
+Field createField(Matrix G)
+{
+    int N = getMatrixSize();
+    int numWords = (N + 63) >> 6;
+    Matrix KInverse = getReconstructionBasis(G);
+    Field F;
+    Bignum e0, last, v, coefficients;
+
+    if(KInverse == NULL) {
+        return NULL;
+    }
+    F = allocateField(N);
+    F->G = allocateMatrix(G);
+    e0 = createBignum(1, N);
+    F->K = allocateMatrix(krylovMatrix(G, e0));
+    F->KInverse = allocateMatrix(KInverse);
+    // e0*G^N = e0*(f(G) - G^N), so the coordinates of v in the rows of K are the
+    // low coefficients of f.
+    last = getMatrixRow(F->K, N - 1);
+    v = vectorMultiplyMatrix(last, G);
+    coefficients = vectorMultiplyMatrix(v, F->KInverse);
+    memcpy(F->modulus, getBignumData(coefficients), numWords*sizeof(uint64));
+    computeMu(F);
+    deleteBignum(e0);
+    deleteBignum(last);
+    deleteBignum(v);
+    deleteBignum(coefficients);
+    return F;
+}
+
+void deleteField(Field F)
+{
+    freeCombTable(F);
+    if(F->G != NULL) {
+        deleteMatrix(F->G);
+        deleteMatrix(F->K);
+        deleteMatrix(F->KInverse);
+    }
+    if(F->squaring != NULL) {
+        deleteMatrix(F->squaring);
+    }
+    if(F->squaringPower != NULL) {
+        deleteMatrix(F->squaringPower);
+    }
+    free(F->modulus);
+    free(F->mu);
+    free(F->product);
+    free(F->quotient);
+    free(F->temp);
+    free(F);
+}
+
+// Return the characteristic polynomial f of the generator, as an N+1 bit Bignum.
+Bignum getFieldModulus(Field F)
+{
+    Bignum f = createBignum(0, F->N + 1);
+
+    memcpy(getBignumData(f), F->modulus, F->numWords*sizeof(uint64));
+    setBignumBit(f, F->N, true);
+    return f;
+}
+
+Bignum fieldMultiply(Field F, Bignum a, Bignum b)
+{
+    Bignum res = createBignum(0, F->N);
+
+    multiplyMod(F, getBignumData(res), getBignumData(a), getBignumData(b));
+    return res;
+}
+
+Bignum fieldSquare(Field F, Bignum a)
+{
+    Bignum res = createBignum(0, F->N);
+
+    squareMod(F, getBignumData(res), getBignumData(a));
+    return res;
+}
+
+// Set selected to entry digit of a table of entries elements, reading every
+// entry and keeping the one we need with a mask, so neither branches nor
+// memory accesses depend on digit.
+static void selectEntry(uint64 *selected, uint64 *table, int entries, int numWords, unsigned digit)
+{
+    uint64 mask;
+    int d, i;
+
+    memset(selected, 0, numWords*sizeof(uint64));
+    for(d = 0; d < entries; d++) {
+        mask = -(uint64)(d == digit);
+        for(i = 0; i < numWords; i++) {
+            selected[i] |= table[d*numWords + i] & mask;
+        }
+    }
+}
+
+// Return bits pos .. pos + numBits - 1 of n, or zeros past its end.
+static inline unsigned getExponentBits(Bignum n, int pos, int numBits)
+{
+    int size = getBignumSize(n);
+    unsigned value = 0;
+    int i;
+
+    for(i = 0; i < numBits && pos + i < size; i++) {
+        value |= getBignumBit(n, pos + i) << i;
+    }
+    return value;
+}
+
+// Compute a^n mod f with windows of chooseWindowBits bits.  In constant-time
+// mode the windows are fixed: each costs the same squarings and one multiply
+// by a masked selection from a table of all the powers a^d for one window d.
+// Otherwise the windows slide, so each starts and ends with a one and only
+// the odd powers of a are needed, and runs of zeros cost only squarings.
+Bignum fieldPow(Field F, Bignum a, Bignum n)
+{
+    Bignum res = createBignum(1, F->N);
+    uint64 *R = getBignumData(res);
+    int words = F->numWords;
+    int size = getBignumSize(n);
+    int windowBits = chooseWindowBits(size);
+    int entries = 1 << windowBits;
+    uint64 *table = (uint64 *)calloc((size_t)entries*words, sizeof(uint64));
+    uint64 *selected, *square;
+    unsigned digit;
+    int i, j, low;
+    bool started = false;
+
+    if(getConstantTime()) {
+        // table[d] is a^d.
+        selected = (uint64 *)calloc(words, sizeof(uint64));
+        table[0] = 1;
+        for(i = 1; i < entries; i++) {
+            multiplyMod(F, table + i*words, table + (i - 1)*words, getBignumData(a));
+        }
+        for(i = (size - 1)/windowBits*windowBits; i >= 0; i -= windowBits) {
+            for(j = 0; j < windowBits; j++) {
+                squareMod(F, R, R);
+            }
+            selectEntry(selected, table, entries, words, getExponentBits(n, i, windowBits));
+            multiplyMod(F, R, R, selected);
+        }
+        free(selected);
+        free(table);
+        return res;
+    }
+    // table[k] is a^(2k + 1).
+    square = (uint64 *)calloc(words, sizeof(uint64));
+    memcpy(table, getBignumData(a), words*sizeof(uint64));
+    squareMod(F, square, table);
+    for(i = 1; i < entries/2; i++) {
+        multiplyMod(F, table + i*words, table + (i - 1)*words, square);
+    }
+    free(square);
+    for(i = size - 1; i >= 0 && !getBignumBit(n, i); i--);
+    while(i >= 0) {
+        if(!getBignumBit(n, i)) {
+            squareMod(F, R, R);
+            i--;
+            continue;
+        }
+        low = i - windowBits + 1 < 0? 0 : i - windowBits + 1;
+        while(!getBignumBit(n, low)) {
+            low++;
+        }
+        digit = 0;
+        for(j = i; j >= low; j--) {
+            digit = (digit << 1) | getBignumBit(n, j);
+            if(started) {
+                squareMod(F, R, R);
+            }
+        }
+        if(started) {
+            multiplyMod(F, R, R, table + (digit >> 1)*words);
+        } else {
+            memcpy(R, table + (digit >> 1)*words, words*sizeof(uint64));
+            started = true;
+        }
+        i = low - 1;
+    }
+    free(table);
+    return res;
+}
+
+// Free F's comb table, or unmap it if it came from a file.
+static void freeCombTable(Field F)
+{
+    if(F->combMap != NULL) {
+        munmap(F->combMap, F->combMapSize);
+    } else {
+        free(F->combTable);
+    }
+    F->combTable = NULL;
+    F->combMap = NULL;
+    F->combWindows = 0;
+}
+
+// Build a comb table of windows of combBits bits, covering N bit exponents.
+// Each window's entries are successive multiples of its base, and the next
+// window's base is the last entry times this one's, so there is no squaring.
+void buildCombTable(Field F, int combBits)
+{
+    int n = F->numWords;
+    int entries = 1 << combBits;
+    uint64 *base = (uint64 *)calloc(n, sizeof(uint64));
+    uint64 *entry;
+    int window, d;
+
+    freeCombTable(F);
+    F->combBits = combBits;
+    F->combWindows = (F->N + combBits - 1)/combBits;
+    F->combTable = (uint64 *)calloc((size_t)F->combWindows*entries*n, sizeof(uint64));
+    base[0] = 2; // x
+    for(window = 0; window < F->combWindows; window++) {
+        entry = F->combTable + (size_t)window*entries*n;
+        entry[0] = 1;
+        for(d = 1; d < entries; d++) {
+            multiplyMod(F, entry + d*n, entry + (d - 1)*n, base);
+        }
+        multiplyMod(F, base, entry + (entries - 1)*n, base);
+    }
+    free(base);
+}
+
+// Write F's comb table to a file, for loadCombTable.
+bool writeCombTable(Field F, char *fileName)
+{
+    uint64 header[COMB_HEADER_WORDS] = {COMB_MAGIC, COMB_VERSION, F->N, F->combBits};
+    size_t tableWords = (size_t)F->combWindows*(1 << F->combBits)*F->numWords;
+    FILE *file;
+
+    if(F->combTable == NULL) {
+        printf("Field has no comb table to write\n");
+        return false;
+    }
+    file = fopen(fileName, "wb");
+    if(file == NULL) {
+        printf("Unable to write to file %s.\n", fileName);
+        return false;
+    }
+    if(fwrite(header, sizeof(uint64), COMB_HEADER_WORDS, file) != COMB_HEADER_WORDS ||
+            fwrite(F->modulus, sizeof(uint64), F->numWords, file) != F->numWords ||
+            fwrite(F->combTable, sizeof(uint64), tableWords, file) != tableWords) {
+        printf("Unable to write comb table to %s\n", fileName);
+        fclose(file);
+        return false;
+    }
+    return fclose(file) == 0;
+}
+
+// Map a comb table file written by writeCombTable.  Return false if there is
+// no such file, or it is for another version or field.
+bool loadCombTable(Field F, char *fileName)
+{
+    int fd = open(fileName, O_RDONLY);
+    struct stat status;
+    uint64 *words;
+    size_t tableWords;
+    void *map;
+    int combBits;
+
+    if(fd < 0) {
+        return false;
+    }
+    if(fstat(fd, &status) != 0 || status.st_size < (COMB_HEADER_WORDS + F->numWords)*8) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+    words = (uint64 *)map;
+    combBits = (int)words[3];
+    if(words[0] != COMB_MAGIC || words[1] != COMB_VERSION || words[2] != F->N ||
+            combBits < 1 || combBits > MAX_COMB_BITS ||
+            memcmp(words + COMB_HEADER_WORDS, F->modulus, F->numWords*sizeof(uint64))) {
+        munmap(map, status.st_size);
+        return false;
+    }
+    tableWords = (size_t)((F->N + combBits - 1)/combBits)*(1 << combBits)*F->numWords;
+    if(status.st_size != (COMB_HEADER_WORDS + F->numWords + tableWords)*8) {
+        munmap(map, status.st_size);
+        return false;
+    }
+    freeCombTable(F);
+    F->combMap = map;
+    F->combMapSize = status.st_size;
+    F->combBits = combBits;
+    F->combWindows = (F->N + combBits - 1)/combBits;
+    F->combTable = words + COMB_HEADER_WORDS + F->numWords;
+    return true;
+}
+
+// Compute x^n with the comb table: one multiply per window, and no squarings.
+// In constant-time mode each window's entry is found with selectEntry.
+static Bignum combPowX(Field F, Bignum n)
+{
+    Bignum res = createBignum(1, F->N);
+    uint64 *R = getBignumData(res);
+    int words = F->numWords;
+    int entries = 1 << F->combBits;
+    uint64 *selected = (uint64 *)calloc(words, sizeof(uint64));
+    uint64 *entry;
+    unsigned digit;
+    int window;
+
+    for(window = 0; window < F->combWindows; window++) {
+        digit = getExponentBits(n, window*F->combBits, F->combBits);
+        entry = F->combTable + (size_t)window*entries*words;
+        if(!getConstantTime()) {
+            if(digit != 0) {
+                multiplyMod(F, R, R, entry + digit*words);
+            }
+            continue;
+        }
+        selectEntry(selected, entry, entries, words, digit);
+        multiplyMod(F, R, R, selected);
+    }
+    free(selected);
+    return res;
+}
+
+// Compute x^n mod f, the polynomial for G^n.  With a comb table, this needs
+// no squarings.
+Bignum fieldPowX(Field F, Bignum n)
+{
+    Bignum x, res;
+
+    if(F->combTable != NULL && getBignumSize(n) <= F->combWindows*F->combBits) {
+        return combPowX(F, n);
+    }
+    x = createBignum(2, F->N);
+    res = fieldPow(F, x, n);
+    deleteBignum(x);
+    return res;
+}
+
+// Return the polynomial p with p(G) == H, given h, the first row of H.  H must
+// be a polynomial in G, as any power of G is.  Like polyToRow, this is a vector
+// product, which is branch-free in constant-time mode, as matrixPowRow needs
+// for the shared secret.
+Bignum rowToPoly(Field F, Bignum row)
+{
+    return vectorMultiplyMatrix(row, F->KInverse);
+}
+
+// Return the first row of p(G).
+Bignum polyToRow(Field F, Bignum p)
+{
+    return vectorMultiplyMatrix(p, F->K);
+}
+
+// Return the first row of H^(2^k), given row, the first row of H, a polynomial
+// in G.  Each squaring is a product with G's squaring map, and k of them are
+// one product with its k-th power, which is kept for the next call with the
+// same k.  For a few squarings of a polynomial, fieldSquare is faster.
+Bignum squareRow(Field F, Bignum row, int k)
+{
+    Bignum power;
+
+    if(F->squaring == NULL) {
+        F->squaring = allocateMatrix(squaringMap(F->G, F->KInverse));
+    }
+    if(k == 1) {
+        return vectorMultiplyMatrix(row, F->squaring);
+    }
+    if(F->squaringPower == NULL || F->squaringExponent != k) {
+        if(F->squaringPower != NULL) {
+            deleteMatrix(F->squaringPower);
+        }
+        power = createBignum(k, 32);
+        F->squaringPower = allocateMatrix(matrixPow(F->squaring, power));
+        F->squaringExponent = k;
+        deleteBignum(power);
+    }
+    return vectorMultiplyMatrix(row, F->squaringPower);
+}
+
+// Return the field for G, building it only if G is not the generator of the
+// last call.  Returns NULL if G has no field.
+static Field getField(Matrix G)
+{
+    if(cachedGenerator != NULL && cachedSize == getMatrixSize() &&
+            matricesEqual(cachedGenerator, G)) {
+        return cachedField;
+    }
+    // Matrices from before initMatrixModule changed N can not go on the new free
+    // list, so those are just dropped.
+    if(cachedGenerator != NULL && cachedSize == getMatrixSize()) {
+        deleteMatrix(cachedGenerator);
+        if(cachedField != NULL) {
+            deleteField(cachedField);
+        }
+    }
+    cachedField = createField(G);
+    cachedGenerator = allocateMatrix(G);
+    cachedSize = getMatrixSize();
+    return cachedField;
+}
+
+// Return the first row of H^n, where H is the matrix commuting with G whose
+// first row is h, as the matrix behind any public key is.  That row is all a
+// shared secret needs, and with G's field it takes only vector products and
+// N bit polynomial multiplies: H^n is never built.  G has no field exactly when
+// its reconstruction basis does not exist, and then h does not determine H, so
+// we return NULL.
+Bignum matrixPowRow(Matrix G, Bignum h, Bignum n)
+{
+    Field F = getField(G);
+    Bignum p, power, row;
+
+    if(F == NULL) {
+        printf("Rows of the generator's powers are dependent, so H can not be found\n");
+        return NULL;
+    }
+    p = rowToPoly(F, h);
+    power = fieldPow(F, p, n);
+    row = polyToRow(F, power);
+    deleteBignum(p);
+    deleteBignum(power);
+    return row;
+}
+
+// Polynomials over GF(2) of any degree, as Bignums: bit i is the coefficient of
+// x^i.  These are for characteristic polynomials and irreducibility tests, so
+// they favor simple long division over speed.
+
+// Return the degree of the polynomial in these words, or -1 if it is zero.
+static int wordsDegree(uint64 *a, int numWords)
+{
+    int i;
+
+    for(i = numWords - 1; i >= 0; i--) {
+        if(a[i] != 0) {
+            return (i << 6) + 63 - __builtin_clzll(a[i]);
+        }
+    }
+    return -1;
+}
+
+// Return the degree of a, or -1 if it is zero.
+int polyDegree(Bignum a)
+{
+    return wordsDegree(getBignumData(a), (getBignumSize(a) + 63) >> 6);
+}
+
+// XOR b*x^shift into a.  a must have room for the result.
+static void xorShifted(uint64 *a, uint64 *b, int bWords, int shift)
+{
+    int wordShift = shift >> 6;
+    int bitShift = shift & 0x3f;
+    uint64 high;
+    int i;
+
+    for(i = 0; i < bWords; i++) {
+        a[i + wordShift] ^= b[i] << bitShift;
+        high = bitShift == 0? 0 : b[i] >> (64 - bitShift);
+        if(high != 0) {
+            a[i + wordShift + 1] ^= high;
+        }
+    }
+}
+
+// Set a to a mod b, where b has degree bDegree >= 0.  If quotient is not NULL,
+// the quotient's bits are set in it.
+static void remainderWords(uint64 *a, int aWords, uint64 *b, int bDegree, uint64 *quotient)
+{
+    int bWords = (bDegree >> 6) + 1;
+    int degree, shift;
+
+    while((degree = wordsDegree(a, aWords)) >= bDegree) {
+        shift = degree - bDegree;
+        xorShifted(a, b, bWords, shift);
+        if(quotient != NULL) {
+            quotient[shift >> 6] |= (uint64)1 << (shift & 0x3f);
+        }
+        aWords = (degree >> 6) + 1; // The words above are now zero
+    }
+}
+
+// Return a copy of a's words, padded with zeros to numWords words.
+static uint64 *copyWords(Bignum a, int numWords)
+{
+    uint64 *words = (uint64 *)calloc(numWords, sizeof(uint64));
+    int aWords = (getBignumSize(a) + 63) >> 6;
+
+    memcpy(words, getBignumData(a), (aWords < numWords? aWords : numWords)*sizeof(uint64));
+    return words;
+}
+
+// Return a Bignum of the given size holding the polynomial in these words.
+static Bignum wordsToBignum(uint64 *words, int numWords, int bits)
+{
+    Bignum res = createBignum(0, bits);
+    int resWords = (bits + 63) >> 6;
+
+    memcpy(getBignumData(res), words, (resWords < numWords? resWords : numWords)*sizeof(uint64));
+    return res;
+}
+
+Bignum polyMultiply(Bignum a, Bignum b)
+{
+    int bits = getBignumSize(a) > getBignumSize(b)? getBignumSize(a) : getBignumSize(b);
+    int numWords = (bits + 63) >> 6;
+    uint64 *aWords = copyWords(a, numWords);
+    uint64 *bWords = copyWords(b, numWords);
+    uint64 *product = (uint64 *)calloc(2*numWords, sizeof(uint64));
+    Bignum res;
+
+    if(clmulWords == NULL) {
+        selectClmul();
+    }
+    clmulWords(product, aWords, bWords, numWords);
+    res = wordsToBignum(product, 2*numWords, getBignumSize(a) + getBignumSize(b));
+    free(aWords);
+    free(bWords);
+    free(product);
+    return res;
+}
+
+// Return a/b, rounded down.  b must not be zero.
+Bignum polyDivide(Bignum a, Bignum b)
+{
+    int aWords = (getBignumSize(a) + 63) >> 6;
+    uint64 *remainder = copyWords(a, aWords);
+    Bignum quotient = createBignum(0, getBignumSize(a));
+
+    remainderWords(remainder, aWords, getBignumData(b), polyDegree(b), getBignumData(quotient));
+    free(remainder);
+    return quotient;
+}
+
+// Return a mod b.  b must not be zero.
+Bignum polyRemainder(Bignum a, Bignum b)
+{
+    int aWords = (getBignumSize(a) + 63) >> 6;
+    uint64 *remainder = copyWords(a, aWords);
+    Bignum res;
+
+    remainderWords(remainder, aWords, getBignumData(b), polyDegree(b), NULL);
+    res = wordsToBignum(remainder, aWords, getBignumSize(b));
+    free(remainder);
+    return res;
+}
+
+// Euclid's algorithm on words, which are overwritten.  Returns the words that
+// hold the gcd, which is a or b.
+static uint64 *gcdWords(uint64 *a, uint64 *b, int numWords)
+{
+    uint64 *temp;
+    int bDegree;
+
+    while((bDegree = wordsDegree(b, numWords)) >= 0) {
+        remainderWords(a, numWords, b, bDegree, NULL);
+        temp = a;
+        a = b;
+        b = temp;
+    }
+    return a;
+}
+
+Bignum polyGcd(Bignum a, Bignum b)
+{
+    int bits = getBignumSize(a) > getBignumSize(b)? getBignumSize(a) : getBignumSize(b);
+    int numWords = (bits + 63) >> 6;
+    uint64 *aWords = copyWords(a, numWords);
+    uint64 *bWords = copyWords(b, numWords);
+    Bignum res = wordsToBignum(gcdWords(aWords, bWords, numWords), numWords, bits);
+
+    free(aWords);
+    free(bWords);
+    return res;
+}
+
+// Return true if n is prime.  n is a polynomial degree, so trial division is fine.
+static bool isPrime(int n)
+{
+    int d;
+
+    if(n < 2) {
+        return false;
+    }
+    for(d = 2; d*d <= n; d++) {
+        if(n % d == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Return true if a, which is reduced mod f, is prime to f.  a and b must have
+// numWords + 1 words, and are overwritten.
+static bool isPrimeToModulus(uint64 *a, uint64 *b, Bignum f, int numWords)
+{
+    a[numWords] = 0;
+    memcpy(b, getBignumData(f), ((polyDegree(f) >> 6) + 1)*sizeof(uint64));
+    return wordsDegree(gcdWords(a, b, numWords + 1), numWords + 1) == 0;
+}
+
+// Rabin's test: f of degree n is irreducible if and only if x^(2^n) = x mod f,
+// and x^(2^(n/q)) - x is prime to f for each prime q dividing n.  The powers
+// x^(2^k) are successive squarings in the field of polynomials mod f, so this
+// costs n squarings and a gcd per prime factor of n.  Random polynomials
+// usually have a small factor, and a factor of degree d divides x^(2^d) - x, so
+// while k <= n/2 we also keep the product of the x^(2^k) - x, and check it is
+// prime to f whenever k is a power of two, as in Ben-Or's test.  Reducible f
+// then usually fail after about twice the degree of their smallest factor in
+// squarings, rather than n.
+bool isIrreducible(Bignum f)
+{
+    int n = polyDegree(f);
+    Field F;
+    uint64 *h, *product, *a, *b;
+    bool irreducible = true;
+    int k, numWords;
+
+    if(n <= 1) {
+        return n == 1;
+    }
+    F = allocateField(n);
+    numWords = F->numWords;
+    memcpy(F->modulus, getBignumData(f), numWords*sizeof(uint64));
+    F->modulus[numWords - 1] &= F->topMask;
+    computeMu(F);
+    h = (uint64 *)calloc(numWords, sizeof(uint64));
+    product = (uint64 *)calloc(numWords, sizeof(uint64));
+    a = (uint64 *)calloc(numWords + 1, sizeof(uint64));
+    b = (uint64 *)calloc(numWords + 1, sizeof(uint64));
+    h[0] = 2; // x
+    product[0] = 1;
+    for(k = 1; k <= n && irreducible; k++) {
+        squareMod(F, h, h);
+        if(2*k <= n) {
+            memcpy(a, h, numWords*sizeof(uint64));
+            a[0] ^= 2;
+            multiplyMod(F, product, product, a);
+            if((k & (k - 1)) == 0) {
+                memcpy(a, product, numWords*sizeof(uint64));
+                irreducible = isPrimeToModulus(a, b, f, numWords);
+            }
+        }
+        if(irreducible && k < n && n % k == 0 && isPrime(n/k)) {
+            memcpy(a, h, numWords*sizeof(uint64));
+            a[0] ^= 2;
+            irreducible = isPrimeToModulus(a, b, f, numWords);
+        }
+    }
+    irreducible = irreducible && h[0] == 2 && wordsDegree(h + 1, numWords - 1) == -1;
+    free(h);
+    free(product);
+    free(a);
+    free(b);
+    deleteField(F);
+    return irreducible;
+}
+
+// Return true if f, of degree n, has an irreducible factor of degree at most
+// maxDegree, where 2^maxDegree < n.  The irreducible factors of x^(2^k) - x are
+// those with degree dividing k, and every degree up to maxDegree divides some k
+// in maxDegree/2 + 1 .. maxDegree, so we take a gcd with each of those.  They
+// are short next to f, so this is far cheaper than Rabin's test.
+static bool hasSmallFactor(Bignum f, int maxDegree)
+{
+    int fWords = (getBignumSize(f) + 63) >> 6;
+    int gWords = ((1 << maxDegree) >> 6) + 1;
+    uint64 *r = (uint64 *)calloc(fWords, sizeof(uint64));
+    uint64 *g = (uint64 *)calloc(gWords, sizeof(uint64));
+    bool found = false;
+    int k, degree;
+
+    for(k = maxDegree/2 + 1; k <= maxDegree && !found; k++) {
+        degree = 1 << k;
+        memset(g, 0, gWords*sizeof(uint64));
+        g[degree >> 6] = (uint64)1 << (degree & 0x3f);
+        g[0] ^= 2; // x^(2^k) - x
+        memcpy(r, getBignumData(f), fWords*sizeof(uint64));
+        remainderWords(r, fWords, g, degree, NULL);
+        found = wordsDegree(gcdWords(g, r, gWords), gWords) > 0;
+    }
+    free(r);
+    free(g);
+    return found;
+}
+
+// Return a random irreducible polynomial of degree n >= 1, as an n+1 bit Bignum.
+// About one polynomial in n is irreducible, so we try about n/2 with a constant
+// term, and sieve out those with small factors before running Rabin's test.
+Bignum randomIrreduciblePolynomial(int n)
+{
+    Bignum f = createBignum(0, n + 1);
+    uint64 *data = getBignumData(f);
+    int numWords = (n >> 6) + 1;
+    int maxDegree = 0;
+    int i;
+
+    while(maxDegree < SIEVE_DEGREE && (2 << maxDegree) < n) {
+        maxDegree++;
+    }
+    while(true) {
+        for(i = 0; i < numWords; i++) {
+            data[i] = randomUint64();
+        }
+        data[numWords - 1] &= ((uint64)1 << (n & 0x3f)) - 1;
+        data[numWords - 1] |= (uint64)1 << (n & 0x3f);
+        data[0] |= 1; // Otherwise x divides f
+        if((maxDegree == 0 || !hasSmallFactor(f, maxDegree)) && isIrreducible(f)) {
+            return f;
+        }
+    }
+    return NULL; // Dummy return
+}
+
+// Check the polynomial engine against matrix powers of G, and the PCLMULQDQ
+// multiply against the scalar one.
+bool fieldTest(Matrix G)
+{
+    Field F = createField(G);
+    Bignum n, p, a, b, x, row;
+    Bignum keys[10];
+    Matrix results[10];
+    bool passed = true;
+    bool savedUseClmul = useClmul;
+    bool savedConstantTime = getConstantTime();
+    int i;
+
+    if(F == NULL) {
+        printf("Generator has no polynomial field\n");
+        return false;
+    }
+    initRandomModule(false);
+    for(i = 0; i < 10 && passed; i++) {
+        n = createBignum(randomUint64(), F->N);
+        p = fieldPowX(F, n);
+        row = getMatrixRow(matrixPow(G, n), 0);
+        passed = bignumsEqual(polyToRow(F, p), row) && bignumsEqual(rowToPoly(F, row), p);
+        passed = passed && matricesEqual(reconstructMatrix(G, row), matrixPow(G, n));
+        keys[i] = row;
+        a = matrixPowRow(G, row, n);
+        passed = passed && bignumsEqual(a, getMatrixRow(matrixPow(matrixPow(G, n), n), 0));
+        deleteBignum(a);
+        setUseClmul(false);
+        a = fieldMultiply(F, p, p);
+        b = fieldSquare(F, p);
+        setUseClmul(savedUseClmul);
+        passed = passed && bignumsEqual(a, fieldMultiply(F, p, p)) &&
+            bignumsEqual(b, fieldSquare(F, p)) && bignumsEqual(a, b);
+        setConstantTime(!savedConstantTime);
+        a = fieldPowX(F, n);
+        setConstantTime(savedConstantTime);
+        passed = passed && bignumsEqual(a, p);
+        deleteBignum(a);
+        deleteBignum(b);
+        // row makes a full size exponent, for the widest windows.
+        a = fieldPow(F, p, row);
+        setConstantTime(!savedConstantTime);
+        b = fieldPow(F, p, row);
+        setConstantTime(savedConstantTime);
+        passed = passed && bignumsEqual(a, b);
+        deleteBignum(n);
+        deleteBignum(p);
+        deleteBignum(a);
+        deleteBignum(b);
+    }
+    // Batched reconstruction must agree with one key at a time.
+    reconstructMatrices(G, keys, results, i);
+    while(i-- > 0) {
+        passed = passed && matricesEqual(results[i], reconstructMatrix(G, keys[i]));
+        deleteMatrix(results[i]);
+        deleteBignum(keys[i]);
+    }
+    // The squaring map must agree with fieldSquare, and for a good generator,
+    // N squarings are the identity.
+    b = createBignum(randomUint64(), F->N);
+    n = fieldPowX(F, b);
+    deleteBignum(b);
+    row = polyToRow(F, n);
+    p = fieldSquare(F, fieldSquare(F, fieldSquare(F, n)));
+    a = squareRow(F, row, 3);
+    b = squareRow(F, row, F->N);
+    passed = passed && bignumsEqual(a, polyToRow(F, p)) && bignumsEqual(b, row);
+    deleteBignum(a);
+    deleteBignum(b);
+    a = squareRow(F, row, 1);
+    passed = passed && bignumsEqual(a, polyToRow(F, fieldSquare(F, n)));
+    deleteBignum(n);
+    deleteBignum(p);
+    deleteBignum(a);
+    deleteBignum(row);
+    // The comb table must give the same powers of x, in both modes.
+    buildCombTable(F, 4);
+    x = createBignum(2, F->N);
+    for(i = 0; i < 10 && passed; i++) {
+        n = createBignum(randomUint64(), F->N);
+        p = fieldPow(F, x, n);
+        a = fieldPowX(F, n);
+        setConstantTime(!savedConstantTime);
+        b = fieldPowX(F, n);
+        setConstantTime(savedConstantTime);
+        passed = bignumsEqual(a, p) && bignumsEqual(b, p);
+        deleteBignum(n);
+        deleteBignum(p);
+        deleteBignum(a);
+        deleteBignum(b);
+    }
+    deleteBignum(x);
+    deleteField(F);
+    if(!passed) {
+        printf("Failed polynomial field test for N = %d.\n", getMatrixSize());
+        return false;
+    }
+    printf("Passed polynomial field test.\n");
+    return true;
+}
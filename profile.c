@@ -0,0 +1,200 @@
+// Per-host tuning profiles.  The autotune tool benchmarks the multiply and
+// elimination strategies for each generator size, and writes the winners to a
+// profile, which initMatrixModule loads.  One profile file can hold sections
+// for several hosts, so a shared home directory works across our hardware
+// generations.  A section looks like:
+//
+//     host <hostname>
+//     <N> <multiply> <elimination> <simd> <m4rmBits> <tileWords> <tileRows>
+//         <tablesPerPass> <threads> <strassenCrossover>
+//
+// with one line per matrix size.
+
+#define _DEFAULT_SOURCE // For gethostname
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bmat.h"
+
+#define MAX_LINE 256
+#define MAX_NAME 64
+
+static char *profileFile;
+static bool profileFileSet;
+
+// Return the profile file name: the one set with setProfileFile, else
+// $BMAT_PROFILE, else ~/.bmat_profile.  Returns NULL if there is none.
+char *getProfileFile(void)
+{
+    static char defaultFile[MAX_LINE];
+    char *value = getenv("BMAT_PROFILE");
+    char *home = getenv("HOME");
+
+    if(profileFileSet) {
+        return profileFile;
+    }
+    if(value != NULL) {
+        return *value != '\0'? value : NULL; // An empty BMAT_PROFILE turns profiles off
+    }
+    if(home == NULL) {
+        return NULL;
+    }
+    snprintf(defaultFile, MAX_LINE, "%s/.bmat_profile", home);
+    return defaultFile;
+}
+
+// Use the profile file, or no profile at all if fileName is NULL.
+void setProfileFile(char *fileName)
+{
+    profileFile = fileName;
+    profileFileSet = true;
+}
+
+static void getHostName(char *hostName)
+{
+    if(gethostname(hostName, MAX_NAME) != 0) {
+        strcpy(hostName, "unknown");
+    }
+    hostName[MAX_NAME - 1] = '\0';
+}
+
+// Return true if the line starts the section for the named host.
+static bool isHostLine(char *line, char *hostName)
+{
+    char name[MAX_NAME];
+
+    return sscanf(line, "host %63s", name) == 1 && (hostName == NULL || !strcmp(name, hostName));
+}
+
+// Fill in the profile with the settings in use now.
+void getCurrentProfile(TuningProfile *profile)
+{
+    profile->N = getMatrixSize();
+    profile->multiplyMethod = getMultiplyMethod();
+    profile->eliminationMethod = getEliminationMethod();
+    profile->simdLevel = getSimdLevel();
+    profile->m4rmBits = getM4RMBits();
+    getTileSizes(&profile->tileWords, &profile->tileRows, &profile->tablesPerPass);
+    profile->numThreads = getNumThreads();
+    profile->strassenCrossover = getStrassenCrossover();
+}
+
+// Switch to the settings in the profile.  The matrix module must already be
+// set up for the profile's N.
+void applyProfile(TuningProfile *profile)
+{
+    setSimdLevel(profile->simdLevel);
+    setMultiplyMethod(profile->multiplyMethod);
+    setEliminationMethod(profile->eliminationMethod);
+    setM4RMBits(profile->m4rmBits);
+    setTileSizes(profile->tileWords, profile->tileRows, profile->tablesPerPass);
+    setNumThreads(profile->numThreads);
+    setStrassenCrossover(profile->strassenCrossover);
+}
+
+// Parse a profile line.  Return false if it is not a valid entry.
+static bool parseProfile(char *line, TuningProfile *profile)
+{
+    char multiply[MAX_NAME], elimination[MAX_NAME], simd[MAX_NAME];
+    int i;
+
+    if(sscanf(line, "%d %63s %63s %63s %d %d %d %d %d %d", &profile->N, multiply, elimination,
+            simd, &profile->m4rmBits, &profile->tileWords, &profile->tileRows,
+            &profile->tablesPerPass, &profile->numThreads, &profile->strassenCrossover) != 10) {
+        return false;
+    }
+    for(i = MULTIPLY_AUTO; i <= MULTIPLY_MASKED &&
+        strcmp(multiply, getMultiplyMethodName(i)); i++);
+    profile->multiplyMethod = i;
+    for(i = ELIMINATE_AUTO; i <= ELIMINATE_M4RI &&
+        strcmp(elimination, getEliminationMethodName(i)); i++);
+    profile->eliminationMethod = i;
+    for(i = SIMD_SCALAR; i <= SIMD_AVX512 && strcmp(simd, getSimdLevelName(i)); i++);
+    profile->simdLevel = i;
+    return profile->multiplyMethod <= MULTIPLY_MASKED &&
+        profile->eliminationMethod <= ELIMINATE_M4RI && profile->simdLevel <= SIMD_AVX512;
+}
+
+// Read this host's profile for matrices of width N.  Return false if there is no
+// profile file, or it has no entry for N on this host.
+bool readProfile(int N, TuningProfile *profile)
+{
+    char *fileName = getProfileFile();
+    char line[MAX_LINE], hostName[MAX_NAME];
+    bool inSection = false;
+    bool found = false;
+    FILE *file;
+
+    if(fileName == NULL || (file = fopen(fileName, "r")) == NULL) {
+        return false;
+    }
+    getHostName(hostName);
+    while(!found && fgets(line, MAX_LINE, file) != NULL) {
+        if(isHostLine(line, NULL)) {
+            inSection = isHostLine(line, hostName);
+        } else if(inSection && parseProfile(line, profile) && profile->N == N) {
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+static void writeProfile(FILE *file, TuningProfile *profile)
+{
+    fprintf(file, "%d %s %s %s %d %d %d %d %d %d\n", profile->N,
+        getMultiplyMethodName(profile->multiplyMethod),
+        getEliminationMethodName(profile->eliminationMethod),
+        getSimdLevelName(profile->simdLevel), profile->m4rmBits, profile->tileWords,
+        profile->tileRows, profile->tablesPerPass, profile->numThreads,
+        profile->strassenCrossover);
+}
+
+// Replace this host's section of the profile file with the profiles, keeping the
+// other hosts' sections.  The new file is written beside the old one and renamed
+// over it, so readers never see a partial profile.
+bool writeProfiles(TuningProfile *profiles, int numProfiles)
+{
+    char *fileName = getProfileFile();
+    char tempName[MAX_LINE + 8], line[MAX_LINE], hostName[MAX_NAME];
+    bool inSection = false;
+    FILE *oldFile, *file;
+    int i;
+
+    if(fileName == NULL) {
+        printf("No profile file to write\n");
+        return false;
+    }
+    snprintf(tempName, sizeof(tempName), "%s.new", fileName);
+    file = fopen(tempName, "w");
+    if(file == NULL) {
+        printf("Unable to write to file %s.\n", tempName);
+        return false;
+    }
+    getHostName(hostName);
+    fprintf(file, "# Matrix kernel tuning profiles, written by autotune.  Each line is:\n"
+        "# N multiply elimination simd m4rmBits tileWords tileRows tablesPerPass "
+        "threads strassenCrossover\n");
+    oldFile = fopen(fileName, "r");
+    if(oldFile != NULL) {
+        while(fgets(line, MAX_LINE, oldFile) != NULL) {
+            if(isHostLine(line, NULL)) {
+                inSection = isHostLine(line, hostName);
+            }
+            if(line[0] != '#' && !inSection) {
+                fputs(line, file);
+            }
+        }
+        fclose(oldFile);
+    }
+    fprintf(file, "host %s\n", hostName);
+    for(i = 0; i < numProfiles; i++) {
+        writeProfile(file, profiles + i);
+    }
+    if(fclose(file) != 0 || rename(tempName, fileName) != 0) {
+        printf("Unable to write to file %s.\n", fileName);
+        return false;
+    }
+    return true;
+}
@@ -5,7 +5,7 @@
 
 int main(int argc, char **argv)
 {
-    Matrix G, theirPubM, sharedM;
+    Matrix G;
     Bignum myPriv, theirPub, sharedKey;
     int N;
 
@@ -20,9 +20,11 @@ int main(int argc, char **argv)
         return 1;
     }
     G = getGenerator(N);
-    theirPubM = reconstructMatrix(G, theirPub);
-    sharedM = matrixPow(theirPubM, myPriv);
-    sharedKey = getMatrixRow(sharedM, 0);
+    setConstantTime(true); // Do not leak the private key through timing
+    sharedKey = matrixPowRow(G, theirPub, myPriv);
+    if(sharedKey == NULL) {
+        return 1;
+    }
     showBignum(sharedKey);
     return 0;
 }
@@ -0,0 +1,519 @@
+// Row kernels for XORing and ANDing rows of uint64 words.  There is a version
+// for each SIMD instruction set, and the best one the CPU supports is chosen at
+// run time, so one binary runs well on all of our hosts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
+static SimdLevel simdLevel = SIMD_SCALAR;
+static bool usePopcount = true;
+static bool initialized = false;
+
+void (*xorRowWords)(uint64 *dest, uint64 *source, int numWords);
+void (*xorRowWords3)(uint64 *dest, uint64 *a, uint64 *b, int numWords);
+uint64 (*andXorWords)(uint64 *a, uint64 *b, int numWords);
+int (*dotProductWords)(uint64 *a, uint64 *b, int numWords);
+void (*transposeBlock)(uint64 *block);
+
+// Masks of the low half of each group of 2j bits, for j = 32, 16, ... 1.
+static const uint64 transposeMasks[6] = {
+    0x00000000ffffffffULL, 0x0000ffff0000ffffULL, 0x00ff00ff00ff00ffULL,
+    0x0f0f0f0f0f0f0f0fULL, 0x3333333333333333ULL, 0x5555555555555555ULL
+};
+
+// Scalar kernels, which run anywhere.
+
+// XOR the source row into the dest row.
+static void xorRowWordsScalar(uint64 *dest, uint64 *source, int numWords)
+{
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        dest[i] ^= source[i];
+    }
+}
+
+// Set the dest row to a XOR b.
+static void xorRowWords3Scalar(uint64 *dest, uint64 *a, uint64 *b, int numWords)
+{
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        dest[i] = a[i] ^ b[i];
+    }
+}
+
+// Return the XOR of a[i] & b[i] over all words.  The parity of the result is
+// the dot product of the two rows.
+static uint64 andXorWordsScalar(uint64 *a, uint64 *b, int numWords)
+{
+    uint64 value = 0;
+    int i;
+
+    for(i = 0; i < numWords; i++) {
+        value ^= a[i] & b[i];
+    }
+    return value;
+}
+
+// Return the dot product of the two rows, using four lookups in parityTable to
+// find the parity.  This is the fallback for CPUs without POPCNT.
+static int dotProductWordsTable(uint64 *a, uint64 *b, int numWords)
+{
+    uint64 v = andXorWords(a, b, numWords);
+
+    return parityTable[(unsigned short)v] ^ parityTable[(unsigned short)(v >> 16)] ^
+        parityTable[(unsigned short)(v >> 32)] ^ parityTable[(unsigned short)(v >> 48)];
+}
+
+// One step of the 64x64 bit transpose: for each pair of rows j apart, swap the
+// high j bits of each 2j-bit group in the first row with the low j bits in the
+// second.  After the steps for j = 32, 16, ... 1, bit c of row r has moved to
+// bit r of row c.
+static void transposeStepScalar(uint64 *block, int j, uint64 mask)
+{
+    uint64 t;
+    int k;
+
+    for(k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+        t = ((block[k] >> j) ^ block[k | j]) & mask;
+        block[k] ^= t << j;
+        block[k | j] ^= t;
+    }
+}
+
+// Transpose the 64x64 bit block of 64 words in place.
+static void transposeBlockScalar(uint64 *block)
+{
+    int step;
+
+    for(step = 0; step < 6; step++) {
+        transposeStepScalar(block, 32 >> step, transposeMasks[step]);
+    }
+}
+
+#ifdef X86_SIMD
+
+// SSE2 kernels.  Every x86-64 CPU has SSE2.
+
+__attribute__((target("sse2")))
+static void xorRowWordsSSE2(uint64 *dest, uint64 *source, int numWords)
+{
+    __m128i d, s;
+    int i;
+
+    for(i = 0; i + 2 <= numWords; i += 2) {
+        d = _mm_loadu_si128((__m128i *)(dest + i));
+        s = _mm_loadu_si128((__m128i *)(source + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(d, s));
+    }
+    if(i < numWords) {
+        dest[i] ^= source[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void xorRowWords3SSE2(uint64 *dest, uint64 *a, uint64 *b, int numWords)
+{
+    __m128i x, y;
+    int i;
+
+    for(i = 0; i + 2 <= numWords; i += 2) {
+        x = _mm_loadu_si128((__m128i *)(a + i));
+        y = _mm_loadu_si128((__m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(x, y));
+    }
+    if(i < numWords) {
+        dest[i] = a[i] ^ b[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static uint64 andXorWordsSSE2(uint64 *a, uint64 *b, int numWords)
+{
+    __m128i acc = _mm_setzero_si128();
+    __m128i x, y;
+    uint64 value = 0;
+    int i;
+
+    for(i = 0; i + 2 <= numWords; i += 2) {
+        x = _mm_loadu_si128((__m128i *)(a + i));
+        y = _mm_loadu_si128((__m128i *)(b + i));
+        acc = _mm_xor_si128(acc, _mm_and_si128(x, y));
+    }
+    if(i < numWords) {
+        value = a[i] & b[i];
+    }
+    acc = _mm_xor_si128(acc, _mm_unpackhi_epi64(acc, acc));
+    return value ^ (uint64)_mm_cvtsi128_si64(acc);
+}
+
+// AVX2 kernels.
+
+__attribute__((target("avx2")))
+static void xorRowWordsAVX2(uint64 *dest, uint64 *source, int numWords)
+{
+    __m256i d, s;
+    int i;
+
+    for(i = 0; i + 4 <= numWords; i += 4) {
+        d = _mm256_loadu_si256((__m256i *)(dest + i));
+        s = _mm256_loadu_si256((__m256i *)(source + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(d, s));
+    }
+    for(; i < numWords; i++) {
+        dest[i] ^= source[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void xorRowWords3AVX2(uint64 *dest, uint64 *a, uint64 *b, int numWords)
+{
+    __m256i x, y;
+    int i;
+
+    for(i = 0; i + 4 <= numWords; i += 4) {
+        x = _mm256_loadu_si256((__m256i *)(a + i));
+        y = _mm256_loadu_si256((__m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(x, y));
+    }
+    for(; i < numWords; i++) {
+        dest[i] = a[i] ^ b[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static uint64 andXorWordsAVX2(uint64 *a, uint64 *b, int numWords)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m256i x, y;
+    __m128i half;
+    uint64 value = 0;
+    int i;
+
+    for(i = 0; i + 4 <= numWords; i += 4) {
+        x = _mm256_loadu_si256((__m256i *)(a + i));
+        y = _mm256_loadu_si256((__m256i *)(b + i));
+        acc = _mm256_xor_si256(acc, _mm256_and_si256(x, y));
+    }
+    for(; i < numWords; i++) {
+        value ^= a[i] & b[i];
+    }
+    half = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_xor_si128(half, _mm_unpackhi_epi64(half, half));
+    return value ^ (uint64)_mm_cvtsi128_si64(half);
+}
+
+// AVX-512 kernels.  The ragged end of each row is finished with AVX2 and scalar
+// operations, since masked stores stall the loads that often follow them.
+
+__attribute__((target("avx512f")))
+static void xorRowWordsAVX512(uint64 *dest, uint64 *source, int numWords)
+{
+    __m512i d, s;
+    int i;
+
+    for(i = 0; i + 8 <= numWords; i += 8) {
+        d = _mm512_loadu_si512(dest + i);
+        s = _mm512_loadu_si512(source + i);
+        _mm512_storeu_si512(dest + i, _mm512_xor_si512(d, s));
+    }
+    if(i + 4 <= numWords) {
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(
+            _mm256_loadu_si256((__m256i *)(dest + i)), _mm256_loadu_si256((__m256i *)(source + i))));
+        i += 4;
+    }
+    for(; i < numWords; i++) {
+        dest[i] ^= source[i];
+    }
+}
+
+__attribute__((target("avx512f")))
+static void xorRowWords3AVX512(uint64 *dest, uint64 *a, uint64 *b, int numWords)
+{
+    __m512i x, y;
+    int i;
+
+    for(i = 0; i + 8 <= numWords; i += 8) {
+        x = _mm512_loadu_si512(a + i);
+        y = _mm512_loadu_si512(b + i);
+        _mm512_storeu_si512(dest + i, _mm512_xor_si512(x, y));
+    }
+    if(i + 4 <= numWords) {
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(
+            _mm256_loadu_si256((__m256i *)(a + i)), _mm256_loadu_si256((__m256i *)(b + i))));
+        i += 4;
+    }
+    for(; i < numWords; i++) {
+        dest[i] = a[i] ^ b[i];
+    }
+}
+
+__attribute__((target("avx512f")))
+static uint64 andXorWordsAVX512(uint64 *a, uint64 *b, int numWords)
+{
+    __m512i acc = _mm512_setzero_si512();
+    __m512i x, y;
+    __m256i half;
+    __m128i quarter;
+    __mmask8 mask;
+    int i;
+
+    for(i = 0; i + 8 <= numWords; i += 8) {
+        x = _mm512_loadu_si512(a + i);
+        y = _mm512_loadu_si512(b + i);
+        acc = _mm512_ternarylogic_epi64(acc, x, y, 0x78); // acc ^ (x & y)
+    }
+    if(i < numWords) {
+        mask = (__mmask8)((1 << (numWords - i)) - 1);
+        x = _mm512_maskz_loadu_epi64(mask, a + i);
+        y = _mm512_maskz_loadu_epi64(mask, b + i);
+        acc = _mm512_ternarylogic_epi64(acc, x, y, 0x78);
+    }
+    half = _mm256_xor_si256(_mm512_castsi512_si256(acc), _mm512_extracti64x4_epi64(acc, 1));
+    quarter = _mm_xor_si128(_mm256_castsi256_si128(half), _mm256_extracti128_si256(half, 1));
+    quarter = _mm_xor_si128(quarter, _mm_unpackhi_epi64(quarter, quarter));
+    return (uint64)_mm_cvtsi128_si64(quarter);
+}
+
+// Dot products that find the parity with POPCNT rather than table lookups, so
+// parityTable does not compete with the matrices for L1 cache.
+
+__attribute__((target("sse2,popcnt")))
+static int dotProductWordsSSE2(uint64 *a, uint64 *b, int numWords)
+{
+    return __builtin_popcountll(andXorWordsSSE2(a, b, numWords)) & 1;
+}
+
+__attribute__((target("avx2,popcnt")))
+static int dotProductWordsAVX2(uint64 *a, uint64 *b, int numWords)
+{
+    return __builtin_popcountll(andXorWordsAVX2(a, b, numWords)) & 1;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static int dotProductWordsAVX512(uint64 *a, uint64 *b, int numWords)
+{
+    return __builtin_popcountll(andXorWordsAVX512(a, b, numWords)) & 1;
+}
+
+// Bit block transposes.  The steps that pair whole vectors of rows are done with
+// vector operations.  AVX2 finishes the last two steps with scalar code, while
+// AVX-512 keeps the block in 8 registers and does those steps with permutes.
+
+__attribute__((target("avx2")))
+static void transposeBlockAVX2(uint64 *block)
+{
+    __m256i x, y, t, mask;
+    int step, j, base, k;
+
+    for(step = 0; step < 4; step++) {
+        j = 32 >> step;
+        mask = _mm256_set1_epi64x(transposeMasks[step]);
+        for(base = 0; base < 64; base += 2*j) {
+            for(k = base; k < base + j; k += 4) {
+                x = _mm256_loadu_si256((__m256i *)(block + k));
+                y = _mm256_loadu_si256((__m256i *)(block + k + j));
+                t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(x, j), y), mask);
+                _mm256_storeu_si256((__m256i *)(block + k),
+                    _mm256_xor_si256(x, _mm256_slli_epi64(t, j)));
+                _mm256_storeu_si256((__m256i *)(block + k + j), _mm256_xor_si256(y, t));
+            }
+        }
+    }
+    transposeStepScalar(block, 2, transposeMasks[4]);
+    transposeStepScalar(block, 1, transposeMasks[5]);
+}
+
+// Do a transpose step for rows j < 8 apart, which are in the same register.
+// Each lane is paired with lane k^j, and the low lanes of each pair take the
+// first-row half of the update while the high lanes take the second.
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i transposeLanesAVX512(__m512i x, int j, uint64 maskValue,
+    __m512i partnerIndex, __mmask8 lowLanes)
+{
+    __m512i mask = _mm512_set1_epi64(maskValue);
+    __m512i p = _mm512_permutexvar_epi64(partnerIndex, x);
+    __m512i low = _mm512_xor_si512(x, _mm512_slli_epi64(
+        _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(x, j), p), mask), j));
+    __m512i high = _mm512_xor_si512(x,
+        _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(p, j), x), mask));
+
+    return _mm512_mask_blend_epi64(lowLanes, high, low);
+}
+
+__attribute__((target("avx512f")))
+static void transposeBlockAVX512(uint64 *block)
+{
+    __m512i rows[8];
+    __m512i t, mask;
+    int step, j, i;
+
+    for(i = 0; i < 8; i++) {
+        rows[i] = _mm512_loadu_si512(block + 8*i);
+    }
+    for(step = 0; step < 3; step++) {
+        j = 32 >> step;
+        mask = _mm512_set1_epi64(transposeMasks[step]);
+        for(i = 0; i < 8; i++) {
+            if(!(i & (j >> 3))) {
+                t = _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(rows[i], j),
+                    rows[i + (j >> 3)]), mask);
+                rows[i] = _mm512_xor_si512(rows[i], _mm512_slli_epi64(t, j));
+                rows[i + (j >> 3)] = _mm512_xor_si512(rows[i + (j >> 3)], t);
+            }
+        }
+    }
+    for(i = 0; i < 8; i++) {
+        rows[i] = transposeLanesAVX512(rows[i], 4, transposeMasks[3],
+            _mm512_set_epi64(3, 2, 1, 0, 7, 6, 5, 4), 0x0f);
+        rows[i] = transposeLanesAVX512(rows[i], 2, transposeMasks[4],
+            _mm512_set_epi64(5, 4, 7, 6, 1, 0, 3, 2), 0x33);
+        rows[i] = transposeLanesAVX512(rows[i], 1, transposeMasks[5],
+            _mm512_set_epi64(6, 7, 4, 5, 2, 3, 0, 1), 0x55);
+        _mm512_storeu_si512(block + 8*i, rows[i]);
+    }
+}
+
+#endif
+
+// Return true if the CPU has the POPCNT instruction.
+bool popcountSupported(void)
+{
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("popcnt");
+#else
+    return false;
+#endif
+}
+
+// Select the dot product kernel for the SIMD level, using POPCNT if allowed and
+// supported, and parityTable otherwise.
+static void selectDotProduct(void)
+{
+    dotProductWords = dotProductWordsTable;
+#ifdef X86_SIMD
+    if(!usePopcount || !popcountSupported()) {
+        return;
+    }
+    switch(simdLevel) {
+    case SIMD_AVX512:
+        dotProductWords = dotProductWordsAVX512;
+        break;
+    case SIMD_AVX2:
+        dotProductWords = dotProductWordsAVX2;
+        break;
+    case SIMD_SSE2:
+        dotProductWords = dotProductWordsSSE2;
+        break;
+    default:
+        break;
+    }
+#endif
+}
+
+// Allow or forbid POPCNT in dot products.  Forbidding it forces parityTable.
+void setUsePopcount(bool value)
+{
+    usePopcount = value;
+    selectDotProduct();
+}
+
+// Return true if dot products are using POPCNT.
+bool getUsePopcount(void)
+{
+    return dotProductWords != dotProductWordsTable;
+}
+
+// Return the best SIMD level this CPU and OS support.
+SimdLevel getSupportedSimdLevel(void)
+{
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// Select the kernels for the SIMD level, or the best supported level below it.
+void setSimdLevel(SimdLevel level)
+{
+    SimdLevel supported = getSupportedSimdLevel();
+
+    if(level > supported) {
+        level = supported;
+    }
+    simdLevel = level;
+    switch(level) {
+#ifdef X86_SIMD
+    case SIMD_AVX512:
+        xorRowWords = xorRowWordsAVX512;
+        xorRowWords3 = xorRowWords3AVX512;
+        andXorWords = andXorWordsAVX512;
+        transposeBlock = transposeBlockAVX512;
+        break;
+    case SIMD_AVX2:
+        xorRowWords = xorRowWordsAVX2;
+        xorRowWords3 = xorRowWords3AVX2;
+        andXorWords = andXorWordsAVX2;
+        transposeBlock = transposeBlockAVX2;
+        break;
+    case SIMD_SSE2:
+        xorRowWords = xorRowWordsSSE2;
+        xorRowWords3 = xorRowWords3SSE2;
+        andXorWords = andXorWordsSSE2;
+        transposeBlock = transposeBlockScalar;
+        break;
+#endif
+    default:
+        simdLevel = SIMD_SCALAR;
+        xorRowWords = xorRowWordsScalar;
+        xorRowWords3 = xorRowWords3Scalar;
+        andXorWords = andXorWordsScalar;
+        transposeBlock = transposeBlockScalar;
+        break;
+    }
+    selectDotProduct();
+}
+
+SimdLevel getSimdLevel(void)
+{
+    return simdLevel;
+}
+
+char *getSimdLevelName(SimdLevel level)
+{
+    switch(level) {
+    case SIMD_SSE2: return "SSE2";
+    case SIMD_AVX2: return "AVX2";
+    case SIMD_AVX512: return "AVX-512";
+    default: return "scalar";
+    }
+}
+
+// Select the best kernels for this CPU.  Only the first call does anything, so
+// a level set with setSimdLevel sticks when the matrix module is re-initialized.
+void initSimdModule(void)
+{
+    if(initialized) {
+        return;
+    }
+    setSimdLevel(getSupportedSimdLevel());
+    initialized = true;
+}
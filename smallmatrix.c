@@ -0,0 +1,430 @@
+// A matrix engine for N <= 64, for research sweeps like checkmatrix that run
+// huge numbers of multiplies on small matrices.  A matrix is just N words, one
+// per row, with bit c of word r holding row r, column c.  For N <= 8 the whole
+// matrix is packed into rows[0], with row r in byte r, so a multiply is a few
+// dozen register operations.  Nothing here allocates memory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmat.h"
+
+#define TABLE_BITS 4 // Each slice of 4 rows of B gets a table of its 16 XOR combinations
+#define MAX_SLICES (64/TABLE_BITS)
+#define MAX_FACTORS 64
+
+static int smallN;
+static uint64 rowMask; // The valid bits of a row
+
+// Prime factors of 2^smallN - 1, with repeats.
+static uint64 orderFactors[MAX_FACTORS];
+static int numOrderFactors;
+
+static void factorOrder(void);
+
+// Set the width of small matrices, which must be from 1 to 64.
+void setSmallMatrixSize(int N)
+{
+    smallN = N;
+    rowMask = N == 64? ~(uint64)0 : ((uint64)1 << N) - 1;
+    factorOrder();
+}
+
+int getSmallMatrixSize(void)
+{
+    return smallN;
+}
+
+// Unpack an 8x8 matrix into one word per row.
+static inline void unpack8(SmallMatrix *res, uint64 packed)
+{
+    int row;
+
+    for(row = 0; row < smallN; row++) {
+        res->rows[row] = (packed >> 8*row) & 0xff;
+    }
+}
+
+// Pack rows of up to 8 bits into one word.
+static inline uint64 pack8(const SmallMatrix *M)
+{
+    uint64 packed = 0;
+    int row;
+
+    for(row = 0; row < smallN; row++) {
+        packed |= (M->rows[row] & 0xff) << 8*row;
+    }
+    return packed;
+}
+
+// Multiply two packed 8x8 matrices.  For each k, column k of A is spread into a
+// byte mask per row, and row k of B is copied to every byte, so one AND and XOR
+// adds A[i][k]*B[k][j] to every entry at once.
+static inline uint64 multiply8(uint64 A, uint64 B)
+{
+    uint64 res = 0;
+    int k;
+
+    for(k = 0; k < 8; k++) {
+        res ^= (((A >> k) & 0x0101010101010101ULL)*0xff) &
+            (((B >> 8*k) & 0xff)*0x0101010101010101ULL);
+    }
+    return res;
+}
+
+// Set res to A*B.  res may be A or B.
+void smallMultiply(SmallMatrix *res, const SmallMatrix *A, const SmallMatrix *B)
+{
+    uint64 tables[MAX_SLICES][1 << TABLE_BITS];
+    uint64 word, value;
+    int numSlices, slice, row, i;
+
+    if(smallN <= 8) {
+        res->rows[0] = multiply8(A->rows[0], B->rows[0]);
+        return;
+    }
+    numSlices = (smallN + TABLE_BITS - 1)/TABLE_BITS;
+    for(slice = 0; slice < numSlices; slice++) {
+        tables[slice][0] = 0;
+        for(i = 1; i < (1 << TABLE_BITS); i++) {
+            row = slice*TABLE_BITS + __builtin_ctz(i);
+            tables[slice][i] = tables[slice][i & (i - 1)] ^ (row < smallN? B->rows[row] : 0);
+        }
+    }
+    for(row = 0; row < smallN; row++) {
+        word = A->rows[row];
+        value = 0;
+        for(slice = 0; slice < numSlices; slice++) {
+            value ^= tables[slice][(word >> slice*TABLE_BITS) & ((1 << TABLE_BITS) - 1)];
+        }
+        res->rows[row] = value;
+    }
+}
+
+void smallIdentity(SmallMatrix *res)
+{
+    int row;
+
+    if(smallN <= 8) {
+        res->rows[0] = 0x8040201008040201ULL & (smallN == 8? ~(uint64)0 :
+            ((uint64)1 << 8*smallN) - 1);
+        return;
+    }
+    for(row = 0; row < smallN; row++) {
+        res->rows[row] = (uint64)1 << row;
+    }
+}
+
+bool smallEqual(const SmallMatrix *A, const SmallMatrix *B)
+{
+    if(smallN <= 8) {
+        return A->rows[0] == B->rows[0];
+    }
+    return !memcmp(A->rows, B->rows, smallN*sizeof(uint64));
+}
+
+// Set res to A^n.  res may be A.
+void smallPow(SmallMatrix *res, const SmallMatrix *A, uint64 n)
+{
+    SmallMatrix power = *A;
+
+    smallIdentity(res);
+    while(n != 0) {
+        if(n & 1) {
+            smallMultiply(res, res, &power);
+        }
+        n >>= 1;
+        if(n != 0) {
+            smallMultiply(&power, &power, &power);
+        }
+    }
+}
+
+// Set res to A^(2^k), by squaring k times.
+static void smallPowPowerOfTwo(SmallMatrix *res, const SmallMatrix *A, int k)
+{
+    int i;
+
+    *res = *A;
+    for(i = 0; i < k; i++) {
+        smallMultiply(res, res, res);
+    }
+}
+
+// Return the rank of M, by Gaussian elimination on a copy in registers.
+int smallRank(const SmallMatrix *M)
+{
+    uint64 rows[64];
+    uint64 pivotBit, temp;
+    int rank = 0;
+    int col, row;
+
+    if(smallN <= 8) {
+        for(row = 0; row < smallN; row++) {
+            rows[row] = (M->rows[0] >> 8*row) & 0xff;
+        }
+    } else {
+        memcpy(rows, M->rows, smallN*sizeof(uint64));
+    }
+    for(col = 0; col < smallN; col++) {
+        pivotBit = (uint64)1 << col;
+        for(row = rank; row < smallN && !(rows[row] & pivotBit); row++);
+        if(row == smallN) {
+            continue;
+        }
+        temp = rows[row];
+        rows[row] = rows[rank];
+        rows[rank] = temp;
+        for(row = rank + 1; row < smallN; row++) {
+            rows[row] ^= rows[rank] & -((rows[row] >> col) & 1);
+        }
+        rank++;
+    }
+    return rank;
+}
+
+bool smallIsSingular(const SmallMatrix *M)
+{
+    return smallRank(M) < smallN;
+}
+
+// Fill M with random bits.
+void smallRandomMatrix(SmallMatrix *M)
+{
+    int row;
+
+    if(smallN <= 8) {
+        M->rows[0] = 0;
+        for(row = 0; row < smallN; row++) {
+            M->rows[0] |= (randomUint64() & rowMask) << 8*row;
+        }
+        return;
+    }
+    for(row = 0; row < smallN; row++) {
+        M->rows[row] = randomUint64() & rowMask;
+    }
+}
+
+// Create a random non-singular matrix M where M + I is also non-singular, so M
+// has no eigenvectors.
+void smallRandomNonSingularMatrix(SmallMatrix *M)
+{
+    SmallMatrix A;
+    int row;
+
+    do {
+        smallRandomMatrix(M);
+        smallIdentity(&A);
+        for(row = 0; row < (smallN <= 8? 1 : smallN); row++) {
+            A.rows[row] ^= M->rows[row];
+        }
+    } while(smallIsSingular(M) || smallIsSingular(&A));
+}
+
+// Return the distinct primes that divide n, smallest first.  n <= 64.
+static int primeFactorsOfN(int n, int *primes)
+{
+    int numPrimes = 0;
+    int p;
+
+    for(p = 2; p <= n; p++) {
+        if(n % p == 0) {
+            primes[numPrimes++] = p;
+            while(n % p == 0) {
+                n /= p;
+            }
+        }
+    }
+    return numPrimes;
+}
+
+// Find if sequence A, A^2, A^4, ... , A^(2^(N-1)) has unique elements, and that
+// A^(2^N) == A.  Squaring cycles, so this holds exactly when the cycle length is
+// N: A^(2^N) == A, and A^(2^(N/p)) != A for each prime p dividing N.  That needs
+// no table of the earlier squares.
+bool smallHasGoodPowerOrder(const SmallMatrix *A)
+{
+    SmallMatrix M;
+    int primes[8];
+    int numPrimes = primeFactorsOfN(smallN, primes);
+    int i;
+
+    smallPowPowerOfTwo(&M, A, smallN);
+    if(!smallEqual(&M, A)) {
+        return false;
+    }
+    for(i = 0; i < numPrimes; i++) {
+        smallPowPowerOfTwo(&M, A, smallN/primes[i]);
+        if(smallEqual(&M, A)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Return a*b mod m.
+static inline uint64 mulMod(uint64 a, uint64 b, uint64 m)
+{
+    return (uint64)((unsigned __int128)a*b % m);
+}
+
+static uint64 powMod(uint64 a, uint64 e, uint64 m)
+{
+    uint64 res = 1 % m;
+
+    while(e != 0) {
+        if(e & 1) {
+            res = mulMod(res, a, m);
+        }
+        a = mulMod(a, a, m);
+        e >>= 1;
+    }
+    return res;
+}
+
+// Miller-Rabin with the first 12 primes as bases, which is exact below 2^64.
+static bool isPrime(uint64 n)
+{
+    static const uint64 bases[12] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    uint64 d = n - 1;
+    uint64 x;
+    int s = 0;
+    int i, r;
+
+    if(n < 2) {
+        return false;
+    }
+    for(i = 0; i < 12; i++) {
+        if(n % bases[i] == 0) {
+            return n == bases[i];
+        }
+    }
+    while(!(d & 1)) {
+        d >>= 1;
+        s++;
+    }
+    for(i = 0; i < 12; i++) {
+        x = powMod(bases[i], d, n);
+        if(x == 1 || x == n - 1) {
+            continue;
+        }
+        for(r = 1; r < s && x != n - 1; r++) {
+            x = mulMod(x, x, n);
+        }
+        if(x != n - 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64 gcd(uint64 a, uint64 b)
+{
+    uint64 t;
+
+    while(b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Return a non-trivial factor of the odd composite n, with Pollard's rho.
+static uint64 pollardRho(uint64 n)
+{
+    uint64 x, y, c, d;
+
+    for(c = 1; ; c++) {
+        x = y = 2;
+        d = 1;
+        while(d == 1) {
+            x = (mulMod(x, x, n) + c) % n;
+            y = (mulMod(y, y, n) + c) % n;
+            y = (mulMod(y, y, n) + c) % n;
+            d = gcd(x > y? x - y : y - x, n);
+        }
+        if(d != n) {
+            return d;
+        }
+    }
+}
+
+// Add the prime factors of n to orderFactors.
+static void addFactors(uint64 n)
+{
+    uint64 p, d;
+
+    for(p = 2; p < 1000 && p*p <= n; p++) {
+        while(n % p == 0) {
+            orderFactors[numOrderFactors++] = p;
+            n /= p;
+        }
+    }
+    if(n == 1) {
+        return;
+    }
+    if(isPrime(n)) {
+        orderFactors[numOrderFactors++] = n;
+        return;
+    }
+    d = pollardRho(n);
+    addFactors(d);
+    addFactors(n/d);
+}
+
+// Factor 2^N - 1, the order of a primitive generator.
+static void factorOrder(void)
+{
+    numOrderFactors = 0;
+    addFactors(smallN == 64? ~(uint64)0 : ((uint64)1 << smallN) - 1);
+}
+
+// Return the order of A if it divides 2^N - 1, which it does for any matrix that
+// passes smallHasGoodPowerOrder, or 0 if it does not.  Rather than searching
+// for a cycle, we start from 2^N - 1 and divide out each prime factor q for
+// which A^(order/q) is still the identity.
+uint64 smallFindOrder(const SmallMatrix *A)
+{
+    SmallMatrix M, I;
+    uint64 order = smallN == 64? ~(uint64)0 : ((uint64)1 << smallN) - 1;
+    int i;
+
+    smallIdentity(&I);
+    smallPow(&M, A, order);
+    if(!smallEqual(&M, &I)) {
+        return 0;
+    }
+    for(i = 0; i < numOrderFactors; i++) {
+        smallPow(&M, A, order/orderFactors[i]);
+        if(smallEqual(&M, &I)) {
+            order /= orderFactors[i];
+        }
+    }
+    return order;
+}
+
+// The small-matrix version of checkPrimeOrderTheory: check that every random
+// matrix that passes the tests for a good generator has order 2^N - 1.
+bool smallCheckPrimeOrderTheory(void)
+{
+    SmallMatrix A;
+    uint64 order, maxOrder = smallN == 64? ~(uint64)0 : ((uint64)1 << smallN) - 1;
+    int passes = 0;
+    int i;
+
+    for(i = 0; i < 1000; i++) {
+        smallRandomNonSingularMatrix(&A);
+        if(smallHasGoodPowerOrder(&A)) {
+            order = smallFindOrder(&A);
+            if(order != maxOrder) {
+                printf("Fails for order %d after %d matrices pass.  Total generated was %d\n",
+                    smallN, passes, i+1);
+                return false;
+            }
+            passes++;
+        }
+    }
+    printf("Passed for order %d %d times.  Total generated was %d\n", smallN, passes, i);
+    return true;
+}
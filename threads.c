@@ -0,0 +1,169 @@
+// A persistent pool of worker threads, used to split matrix operations by row
+// ranges.  The workers sleep on a condition variable between jobs, so starting a
+// job costs a wake-up rather than a thread creation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bmat.h"
+
+#define MAX_THREADS 256
+#define CHUNK_ROWS 64 // Chunks start on multiples of this many rows
+
+static int numThreads; // Including the calling thread.  0 until first use.
+static int numWorkers;
+static pthread_t workers[MAX_THREADS];
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+
+// The current job.
+static ParallelFunc jobFunc;
+static void *jobContext;
+static int jobRows, jobChunks;
+static int nextChunk; // The next chunk to hand out
+static int chunksLeft; // Chunks not yet finished
+static unsigned jobGeneration;
+static bool quitting;
+// 0 on the calling thread, and 1 .. numWorkers on the workers.
+static __thread int threadIndex;
+
+// Return the first row of the chunk.  Chunks start on multiples of CHUNK_ROWS
+// rows, so no two threads write bits in the same word of a result vector.
+static int chunkStart(int chunk)
+{
+    if(chunk == jobChunks) {
+        return jobRows;
+    }
+    return (int)(((long long)jobRows*chunk/jobChunks) & ~(long long)(CHUNK_ROWS - 1));
+}
+
+// Run chunks of the current job until there are none left.  Called with the
+// mutex held, and returns with it held.
+static void runChunks(void)
+{
+    int chunk;
+
+    while(nextChunk < jobChunks) {
+        chunk = nextChunk++;
+        pthread_mutex_unlock(&mutex);
+        jobFunc(jobContext, chunkStart(chunk), chunkStart(chunk + 1));
+        pthread_mutex_lock(&mutex);
+        if(--chunksLeft == 0) {
+            pthread_cond_signal(&doneCond);
+        }
+    }
+}
+
+static void *runWorker(void *ptr)
+{
+    unsigned generation = 0;
+
+    threadIndex = (int)(long)ptr;
+    pthread_mutex_lock(&mutex);
+    while(true) {
+        while(!quitting && jobGeneration == generation) {
+            pthread_cond_wait(&startCond, &mutex);
+        }
+        if(quitting) {
+            break;
+        }
+        generation = jobGeneration;
+        runChunks();
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+// Stop and join all the workers.
+static void stopWorkers(void)
+{
+    int i;
+
+    pthread_mutex_lock(&mutex);
+    quitting = true;
+    pthread_cond_broadcast(&startCond);
+    pthread_mutex_unlock(&mutex);
+    for(i = 0; i < numWorkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    numWorkers = 0;
+    quitting = false;
+}
+
+// Return the thread count from BMAT_THREADS, or the number of CPUs.
+static int defaultNumThreads(void)
+{
+    char *value = getenv("BMAT_THREADS");
+    long count = value != NULL? atol(value) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count < 1? 1 : count;
+}
+
+// Set how many threads, including the caller, work on parallel jobs.  0 means
+// use the default.  The workers are started on the next parallel job.
+void setNumThreads(int count)
+{
+    if(count <= 0) {
+        count = defaultNumThreads();
+    }
+    if(count > MAX_THREADS) {
+        count = MAX_THREADS;
+    }
+    stopWorkers();
+    numThreads = count;
+}
+
+int getNumThreads(void)
+{
+    if(numThreads == 0) {
+        numThreads = defaultNumThreads();
+    }
+    return numThreads;
+}
+
+// Return which of the getNumThreads() threads we are on, from 0 to one less than
+// the count, so parallel jobs can keep per-thread work space.
+int getThreadIndex(void)
+{
+    return threadIndex;
+}
+
+// Split rows 0 .. numRows-1 into chunks of at least minRows rows, and call func
+// on each chunk, using the pool's threads.  Returns when all chunks are done.
+// With one chunk, func just runs on the calling thread.  Chunks are aligned to
+// CHUNK_ROWS rows, so smaller minRows would only give some threads no rows.
+void runInParallel(ParallelFunc func, void *context, int numRows, int minRows)
+{
+    int chunks = numRows/(minRows > CHUNK_ROWS? minRows : CHUNK_ROWS);
+
+    if(chunks > getNumThreads()) {
+        chunks = numThreads;
+    }
+    if(chunks <= 1) {
+        func(context, 0, numRows);
+        return;
+    }
+    while(numWorkers < numThreads - 1) {
+        if(pthread_create(workers + numWorkers, NULL, runWorker,
+                (void *)(long)(numWorkers + 1)) != 0) {
+            break;
+        }
+        numWorkers++;
+    }
+    pthread_mutex_lock(&mutex);
+    jobFunc = func;
+    jobContext = context;
+    jobRows = numRows;
+    jobChunks = chunks;
+    nextChunk = 0;
+    chunksLeft = chunks;
+    jobGeneration++;
+    pthread_cond_broadcast(&startCond);
+    runChunks();
+    while(chunksLeft != 0) {
+        pthread_cond_wait(&doneCond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}